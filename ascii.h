@@ -0,0 +1,276 @@
+// vim: sw=2 ts=2 expandtab smartindent
+
+/**
+ * Reading numbers out of, and writing them into, plain byte spans:
+ * what the hot path used to get from fmemopen + fscanf and
+ * open_memstream + fprintf, without the FILE, the locale or the heap.
+ *
+ * The scanners take a cursor `*p` into a span that stops at `end`
+ * (which doesn't need a null terminator), skip whitespace in front
+ * of the number the way scanf does, and move the cursor past it.
+ * They return false, and leave the cursor alone, if there isn't a
+ * number there or it doesn't fit.
+ **/
+
+#ifndef ascii_IMPLEMENTATION
+
+static void ascii_skip_space(const char **p, const char *end);
+/* matches `lit` exactly and moves past it */
+static bool ascii_expect(const char **p, const char *end, const char *lit);
+/* same, but upper and lower case are the same (ASCII only) */
+static bool ascii_expect_nocase(const char **p, const char *end, const char *lit);
+
+static bool ascii_scan_int(const char **p, const char *end, int *out);
+static bool ascii_scan_size(const char **p, const char *end, size_t *out);
+/**
+ * Decimal, with an optional fraction and exponent; no hex, inf or nan.
+ * Exact for up to 15 significant digits and exponents within 10^±22,
+ * which is anything anyone will send for a pixel. Past that it goes
+ * through a long double, and the last bit can come out wrong.
+ **/
+static bool ascii_scan_double(const char **p, const char *end, double *out);
+
+/**
+ * The writers don't null terminate, and return how much they wrote.
+ * `out` needs to have room for the _MAX of what's being written.
+ **/
+#define ASCII_U64_MAX 20
+#define ASCII_I64_MAX 21
+static size_t ascii_put_u64(char *out, uint64_t v);
+static size_t ascii_put_i64(char *out, int64_t v);
+
+/**
+ * Like %lf, six decimals. Anything past 1e18 (or not finite) is left
+ * to snprintf, which is the only way to get all of DBL_MAX's digits.
+ **/
+#define ASCII_DOUBLE_MAX 320
+static size_t ascii_put_double(char *out, double v);
+
+#endif
+
+
+#ifdef ascii_IMPLEMENTATION
+
+static bool ascii_is_space(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static bool ascii_is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static void ascii_skip_space(const char **p, const char *end) {
+  const char *s = *p;
+  while (s < end && ascii_is_space(*s)) s++;
+  *p = s;
+}
+
+static bool ascii_expect(const char **p, const char *end, const char *lit) {
+  const char *s = *p;
+  for (; *lit; lit++, s++)
+    if (s == end || *s != *lit) return false;
+  *p = s;
+  return true;
+}
+
+static char ascii_lower(char c) {
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static bool ascii_expect_nocase(const char **p, const char *end, const char *lit) {
+  const char *s = *p;
+  for (; *lit; lit++, s++)
+    if (s == end || ascii_lower(*s) != ascii_lower(*lit)) return false;
+  *p = s;
+  return true;
+}
+
+/* the sign and digits scanf would take, the magnitude in *mag */
+static bool ascii_scan_u64(
+  const char **p,
+  const char *end,
+  bool allow_minus,
+  bool *neg,
+  uint64_t *mag
+) {
+  const char *s = *p;
+  ascii_skip_space(&s, end);
+
+  *neg = false;
+  if (s < end && (*s == '+' || (allow_minus && *s == '-')))
+    *neg = *s++ == '-';
+
+  if (s == end || !ascii_is_digit(*s)) return false;
+
+  uint64_t v = 0;
+  for (; s < end && ascii_is_digit(*s); s++) {
+    uint64_t d = *s - '0';
+    if (v > (UINT64_MAX - d) / 10) return false;
+    v = v * 10 + d;
+  }
+
+  *mag = v;
+  *p = s;
+  return true;
+}
+
+static bool ascii_scan_int(const char **p, const char *end, int *out) {
+  const char *s = *p;
+  bool neg;
+  uint64_t mag;
+  if (!ascii_scan_u64(&s, end, true, &neg, &mag)) return false;
+  if (mag > (uint64_t)INT_MAX + neg) return false;
+
+  *out = neg ? (int)-(int64_t)mag : (int)mag;
+  *p = s;
+  return true;
+}
+
+static bool ascii_scan_size(const char **p, const char *end, size_t *out) {
+  const char *s = *p;
+  bool neg;
+  uint64_t mag;
+  if (!ascii_scan_u64(&s, end, false, &neg, &mag)) return false;
+  if (mag > SIZE_MAX) return false;
+
+  *out = mag;
+  *p = s;
+  return true;
+}
+
+/* every power of ten a double holds exactly */
+static const double ascii_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+#define ASCII_POW10_EXACT 22
+
+static bool ascii_scan_double(const char **p, const char *end, double *out) {
+  const char *s = *p;
+  ascii_skip_space(&s, end);
+
+  bool neg = false;
+  if (s < end && (*s == '+' || *s == '-'))
+    neg = *s++ == '-';
+
+  /* the first 19 significant digits, and where the point goes */
+  uint64_t mant = 0;
+  int digits = 0, exp10 = 0;
+  bool any = false;
+
+  for (; s < end && ascii_is_digit(*s); s++) {
+    any = true;
+    if (digits < 19) {
+      mant = mant * 10 + (*s - '0');
+      if (mant) digits++;
+    } else
+      exp10++;
+  }
+
+  if (s < end && *s == '.') {
+    s++;
+    for (; s < end && ascii_is_digit(*s); s++) {
+      any = true;
+      if (digits < 19) {
+        mant = mant * 10 + (*s - '0');
+        if (mant) digits++;
+        exp10--;
+      }
+    }
+  }
+
+  if (!any) return false;
+
+  /* only an exponent if there are digits after the e */
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    const char *e = s + 1;
+    bool e_neg = false;
+    if (e < end && (*e == '+' || *e == '-'))
+      e_neg = *e++ == '-';
+
+    if (e < end && ascii_is_digit(*e)) {
+      int x = 0;
+      for (; e < end && ascii_is_digit(*e); e++)
+        if (x < 100000) x = x * 10 + (*e - '0');
+      exp10 += e_neg ? -x : x;
+      s = e;
+    }
+  }
+
+  double v = mant;
+  if (mant != 0) {
+    if (mant <= (1ull << 53) &&
+        exp10 >= -ASCII_POW10_EXACT && exp10 <= ASCII_POW10_EXACT) {
+      /* both of these are exact in a double, so one rounding and done */
+      v = exp10 < 0 ? v / ascii_pow10[-exp10] : v * ascii_pow10[exp10];
+    } else {
+      /* long double holds all 19 digits, which is most of the way there */
+      long double lv = mant;
+      for (; exp10 > 0; exp10 -= ASCII_POW10_EXACT)
+        lv *= ascii_pow10[exp10 < ASCII_POW10_EXACT ? exp10 : ASCII_POW10_EXACT];
+      for (; exp10 < 0; exp10 += ASCII_POW10_EXACT)
+        lv /= ascii_pow10[-exp10 < ASCII_POW10_EXACT ? -exp10 : ASCII_POW10_EXACT];
+      v = lv;
+    }
+
+    /* past DBL_MAX */
+    if (v - v != 0) return false;
+  }
+
+  *out = neg ? -v : v;
+  *p = s;
+  return true;
+}
+
+static size_t ascii_put_u64(char *out, uint64_t v) {
+  /* backwards into a scratch buffer, then the right way around */
+  char tmp[ASCII_U64_MAX];
+  size_t len = 0;
+  do {
+    tmp[len++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+
+  for (size_t i = 0; i < len; i++)
+    out[i] = tmp[len - 1 - i];
+  return len;
+}
+
+static size_t ascii_put_i64(char *out, int64_t v) {
+  if (v >= 0) return ascii_put_u64(out, v);
+
+  out[0] = '-';
+  return 1 + ascii_put_u64(out + 1, -(uint64_t)v);
+}
+
+static size_t ascii_put_double(char *out, double v) {
+  double mag = v < 0 ? -v : v;
+  if (!(mag < 1e18))
+    return snprintf(out, ASCII_DOUBLE_MAX, "%lf", v);
+
+  /* the whole part is exact as an integer, and so is what's left over */
+  uint64_t whole = mag;
+  double micro = (mag - whole) * 1e6;
+
+  /* rounded to the nearest millionth, ties to even, like printf */
+  uint32_t frac = micro;
+  double rest = micro - frac;
+  if (rest > 0.5 || (rest == 0.5 && (frac & 1))) frac++;
+  if (frac == 1000000) {
+    frac = 0;
+    whole++;
+  }
+
+  size_t len = 0;
+  if (v < 0) out[len++] = '-';
+  len += ascii_put_u64(out + len, whole);
+  out[len++] = '.';
+
+  for (int i = 5; i >= 0; i--) {
+    out[len + i] = '0' + frac % 10;
+    frac /= 10;
+  }
+  return len + 6;
+}
+
+#endif
@@ -0,0 +1,128 @@
+// vim: sw=2 ts=2 expandtab smartindent
+
+/**
+ * ascii.h against the stdio calls it replaced, on the two things the
+ * hot path does with text points: scanning "path_id, x, y" out of a
+ * message (fmemopen + fscanf before), and formatting a whole record
+ * (snprintf before).
+ *
+ * gcc -O2 bench/ascii.c -o ascii_bench && ./ascii_bench
+ **/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "../ascii.h"
+#define ascii_IMPLEMENTATION
+#include "../ascii.h"
+
+#define ROUNDS 1000000
+#define INPUTS 256
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* so the compiler can't throw the work away */
+static volatile double sink;
+
+int main(void) {
+  char in[INPUTS][64];
+  size_t in_len[INPUTS];
+  srand(1);
+  for (int i = 0; i < INPUTS; i++)
+    in_len[i] = snprintf(
+      in[i],
+      sizeof(in[i]),
+      "%d, %d.%d, %d",
+      rand() % 100000,
+      rand() % 2000,
+      rand() % 100,
+      rand() % 2000
+    );
+
+  double t = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    size_t id;
+    double x, y;
+    FILE *f = fmemopen(in[r % INPUTS], in_len[r % INPUTS], "r");
+    if (fscanf(f, "%zu, %lf, %lf", &id, &x, &y) < 3) return 1;
+    fclose(f);
+    sink = id + x + y;
+  }
+  double scan_stdio = (now_ns() - t) / ROUNDS;
+
+  t = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    size_t id;
+    double x, y;
+    const char *p = in[r % INPUTS], *end = p + in_len[r % INPUTS];
+    if (!ascii_scan_size(&p, end, &id) ||
+        !ascii_expect(&p, end, ",") ||
+        !ascii_scan_double(&p, end, &x) ||
+        !ascii_expect(&p, end, ",") ||
+        !ascii_scan_double(&p, end, &y))
+      return 1;
+    sink = id + x + y;
+  }
+  double scan_ascii = (now_ns() - t) / ROUNDS;
+
+  char out[2 * ASCII_DOUBLE_MAX + 128];
+
+  t = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    int len = snprintf(
+      out,
+      sizeof(out),
+      "%d, %zu, %zu, %lf, %lf, %u",
+      1,
+      (size_t)r,
+      (size_t)r * 7,
+      r * 0.25,
+      r * 0.5,
+      (unsigned)r
+    );
+    sink = len + out[0];
+  }
+  double format_stdio = (now_ns() - t) / ROUNDS;
+
+  t = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    size_t len = 0;
+    len += ascii_put_i64(out + len, 1);
+    memcpy(out + len, ", ", 2); len += 2;
+    len += ascii_put_u64(out + len, r);
+    memcpy(out + len, ", ", 2); len += 2;
+    len += ascii_put_u64(out + len, (size_t)r * 7);
+    memcpy(out + len, ", ", 2); len += 2;
+    len += ascii_put_double(out + len, r * 0.25);
+    memcpy(out + len, ", ", 2); len += 2;
+    len += ascii_put_double(out + len, r * 0.5);
+    memcpy(out + len, ", ", 2); len += 2;
+    len += ascii_put_u64(out + len, r);
+    sink = len + out[0];
+  }
+  double format_ascii = (now_ns() - t) / ROUNDS;
+
+  printf(
+    "scan   fmemopen+fscanf %7.1f ns   ascii.h %6.1f ns   (%.0fx)\n",
+    scan_stdio,
+    scan_ascii,
+    scan_stdio / scan_ascii
+  );
+  printf(
+    "format snprintf        %7.1f ns   ascii.h %6.1f ns   (%.0fx)\n",
+    format_stdio,
+    format_ascii,
+    format_stdio / format_ascii
+  );
+  return 0;
+}
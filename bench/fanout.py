@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# vim: sw=4 ts=4 expandtab
+"""
+How long a point takes to get from one client to everyone else in the
+room, and how many syscalls the server makes per point it fans out.
+
+Start the server first, then:
+
+    python3 bench/fanout.py [--peers 50] [--points 2000] [--rate 1000]
+
+One client draws --points points at --rate a second, --peers others
+listen, and every listener timestamps every point as it comes in.
+
+The syscall count comes from /proc/<pid>/io (read and write calls) plus
+cketchbook_poll_wakeups_total from /metrics (one poll, epoll_wait or
+io_uring_enter each). io_uring's recvs and sends happen in the kernel
+and don't show up in either, which is the point. It's a close lower
+bound; `strace -c -f` on the server gives the exact breakdown.
+"""
+import argparse, base64, os, re, selectors, socket, struct, subprocess, time
+
+ap = argparse.ArgumentParser()
+ap.add_argument('--host', default='127.0.0.1')
+ap.add_argument('--port', type=int, default=8081)
+ap.add_argument('--pid', type=int, help="the server's, if pgrep a.out won't find it")
+ap.add_argument('--peers', type=int, default=50)
+ap.add_argument('--points', type=int, default=2000)
+ap.add_argument('--rate', type=int, default=1000, help='points a second')
+args = ap.parse_args()
+
+def connect():
+    s = socket.create_connection((args.host, args.port))
+    key = base64.b64encode(os.urandom(16))
+    s.sendall(b'GET /chat/bench HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\n'
+              b'Connection: Upgrade\r\nSec-WebSocket-Version: 13\r\n'
+              b'Sec-WebSocket-Key: ' + key + b'\r\n\r\n')
+    buf = b''
+    while b'\r\n\r\n' not in buf:
+        buf += s.recv(4096)
+    head, rest = buf.split(b'\r\n\r\n', 1)
+    assert b' 101 ' in head.split(b'\r\n')[0], head
+    s.setblocking(False)
+    return s, rest
+
+def frame(text):
+    payload = text.encode()
+    mask = os.urandom(4)
+    masked = bytes(b ^ mask[i % 4] for i, b in enumerate(payload))
+    return bytes([0x81, 0x80 | len(payload)]) + mask + masked
+
+def messages(buf):
+    """whole frames off the front of buf, and what's left over"""
+    out = []
+    while len(buf) >= 2:
+        n, off = buf[1] & 127, 2
+        if n == 126:
+            if len(buf) < 4: break
+            n, off = struct.unpack('>H', buf[2:4])[0], 4
+        elif n == 127:
+            if len(buf) < 10: break
+            n, off = struct.unpack('>Q', buf[2:10])[0], 10
+        if len(buf) < off + n: break
+        out.append((buf[0] & 15, buf[off:off + n]))
+        buf = buf[off + n:]
+    return out, buf
+
+def metric(name):
+    s = socket.create_connection((args.host, args.port))
+    s.sendall(b'GET /metrics HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n')
+    body = b''
+    while True:
+        d = s.recv(65536)
+        if not d: break
+        body += d
+    s.close()
+    return sum(float(v) for v in re.findall(
+        rb'^' + name.encode() + rb'(?:\{[^}]*\})? (\S+)$', body, re.M))
+
+def proc_io(pid):
+    io = dict(l.split(': ') for l in open('/proc/%d/io' % pid).read().split('\n') if l)
+    return int(io['syscr']) + int(io['syscw'])
+
+pid = args.pid or int(subprocess.check_output(['pgrep', '-n', '-x', 'a.out']))
+
+drawer, _ = connect()
+peers = {}
+sel = selectors.DefaultSelector()
+for _ in range(args.peers):
+    s, rest = connect()
+    peers[s] = rest
+    sel.register(s, selectors.EVENT_READ)
+sel.register(drawer, selectors.EVENT_READ)
+
+# let the history snapshots go by
+time.sleep(0.5)
+for key, _ in sel.select(0.5):
+    try:
+        while key.fileobj.recv(1 << 20): pass
+    except BlockingIOError: pass
+for s in peers: peers[s] = b''
+
+syscalls0, wakeups0 = proc_io(pid), metric('cketchbook_poll_wakeups_total')
+
+# path_id is the point's index, so listeners can tell which one it was
+sent_at = [0.0] * args.points
+latency = []
+next_i, start = 0, time.perf_counter()
+deadline = start + args.points / args.rate + 5
+while time.perf_counter() < deadline and len(latency) < args.points * args.peers:
+    now = time.perf_counter()
+    while next_i < args.points and now >= start + next_i / args.rate:
+        sent_at[next_i] = time.perf_counter()
+        drawer.sendall(frame('%d, 10, 10' % next_i))
+        next_i += 1
+
+    for key, _ in sel.select(0.001):
+        s = key.fileobj
+        try:
+            data = s.recv(1 << 20)
+        except BlockingIOError:
+            continue
+        got = time.perf_counter()
+        if s is drawer: continue
+
+        msgs, peers[s] = messages(peers[s] + data)
+        for opcode, p in msgs:
+            if opcode != 1: continue
+            for line in p.split(b'\n'):
+                f = line.split(b', ')
+                if len(f) == 6 and f[0] == b'1':
+                    latency.append(got - sent_at[int(f[2])])
+
+time.sleep(0.2)
+syscalls = proc_io(pid) - syscalls0
+wakeups = metric('cketchbook_poll_wakeups_total') - wakeups0
+
+latency.sort()
+def pct(p): return latency[min(len(latency) - 1, int(len(latency) * p))] * 1e3
+print('peers %d, points %d at %d/s, %d of %d deliveries' % (
+    args.peers, args.points, args.rate, len(latency), args.points * args.peers))
+print('latency ms: p50 %.3f, p99 %.3f, max %.3f' % (pct(0.5), pct(0.99), latency[-1] * 1e3))
+print('syscalls per point: %.2f (%d read/write, %d waits)' % (
+    (syscalls + wakeups) / args.points, syscalls, wakeups))
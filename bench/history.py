@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+# vim: sw=4 ts=4 expandtab
+"""
+What it costs to fill a room's history and then join it, at a few
+history sizes.
+
+Start the server with room for the biggest one first, then:
+
+    ./a.out --history=1000000 &
+    python3 bench/history.py [--sizes 10000,100000,1000000]
+
+For each size, one client draws that many points into a room of its
+own as fast as it can and waits for the last one to come back to it.
+Then a new client joins and is timed until the whole history has
+arrived. Both are reported per point; the join number is mostly the
+server encoding and sending the replay, the ingest one is mostly this
+script.
+"""
+import argparse, base64, os, socket, struct, threading, time
+
+ap = argparse.ArgumentParser()
+ap.add_argument('--host', default='127.0.0.1')
+ap.add_argument('--port', type=int, default=8081)
+ap.add_argument('--sizes', default='10000,100000,1000000')
+args = ap.parse_args()
+
+def connect(path):
+    s = socket.create_connection((args.host, args.port))
+    key = base64.b64encode(os.urandom(16))
+    s.sendall(b'GET ' + path.encode() + b' HTTP/1.1\r\nHost: x\r\n'
+              b'Upgrade: websocket\r\nConnection: Upgrade\r\n'
+              b'Sec-WebSocket-Version: 13\r\n'
+              b'Sec-WebSocket-Key: ' + key + b'\r\n\r\n')
+    buf = b''
+    while b'\r\n\r\n' not in buf:
+        buf += s.recv(4096)
+    head, rest = buf.split(b'\r\n\r\n', 1)
+    assert b' 101 ' in head.split(b'\r\n')[0], head
+    return s, rest
+
+def frame(text):
+    # an all-zero mask leaves the payload as it is, which keeps building
+    # a million of these quick
+    payload = text.encode()
+    return bytes([0x81, 0x80 | len(payload)]) + b'\0\0\0\0' + payload
+
+def points_until(s, buf, n):
+    """reads frames off s until n point records have come in"""
+    got = 0
+    while got < n:
+        while len(buf) < 10:
+            buf += s.recv(1 << 20)
+        size, off = buf[1] & 127, 2
+        if size == 126:
+            size, off = struct.unpack('>H', buf[2:4])[0], 4
+        elif size == 127:
+            size, off = struct.unpack('>Q', buf[2:10])[0], 10
+        while len(buf) < off + size:
+            buf += s.recv(1 << 20)
+        if buf[0] & 15 == 1:
+            # one record a line, and adds start with a 1
+            p = buf[off:off + size]
+            got += p.count(b'\n1, ') + p.startswith(b'1, ')
+        buf = buf[off + size:]
+    return buf
+
+print('%9s %14s %14s %10s' % ('points', 'ingest ns/pt', 'join ns/pt', 'join s'))
+for n in [int(x) for x in args.sizes.split(',')]:
+    room = '/chat/history%d' % n
+    data = b''.join(frame('0, %d, %d' % (i % 2000, i // 2000 % 2000))
+                    for i in range(n))
+
+    drawer, buf = connect(room)
+    start = time.perf_counter()
+    sender = threading.Thread(target=drawer.sendall, args=(data,))
+    sender.start()
+    points_until(drawer, buf, n)
+    ingest = time.perf_counter() - start
+    sender.join()
+
+    start = time.perf_counter()
+    joiner, buf = connect(room)
+    points_until(joiner, buf, n)
+    join = time.perf_counter() - start
+
+    print('%9d %14.0f %14.0f %10.3f' % (n, ingest / n * 1e9, join / n * 1e9, join))
+    drawer.close()
+    joiner.close()
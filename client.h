@@ -9,6 +9,51 @@ typedef enum ClientPhase {
   ClientPhase_Websocket,
 } ClientPhase;
 
+/**
+ * What a websocket client wants its points in. Browsers ask for
+ * binary through Sec-WebSocket-Protocol; anything that doesn't
+ * (wscat, older pages) keeps getting text.
+ **/
+typedef enum {
+  ClientWsFormat_Text,
+  ClientWsFormat_Binary,
+  ClientWsFormat_COUNT,
+} ClientWsFormat;
+#define CLIENT_WS_PROTOCOL_BINARY "cketchbook.bin"
+
+/* longest <room> in /chat/<room> */
+#define CLIENT_WS_ROOM_MAX 32
+
+/**
+ * permessage-deflate, always without context takeover either way.
+ * Every message is compressed on its own, so one compressed frame can
+ * go out to any number of clients, and nobody needs a zlib stream of
+ * their own; the whole server gets by with one of each.
+ **/
+#define CLIENT_WS_EXTENSION_DEFLATE \
+  "permessage-deflate; server_no_context_takeover; client_no_context_takeover"
+
+/**
+ * The biggest frame header there is (64 bit length, no mask),
+ * and the most we'll put in one message, either direction.
+ **/
+#define CLIENT_WS_HEADER_MAX 10
+#define CLIENT_WS_PAYLOAD_MAX MAX_MESSAGE_SIZE
+
+/**
+ * An already framed websocket message that can sit in a bunch of
+ * clients' response queues at once, so a broadcast is encoded once
+ * instead of once per peer. Freed when the last one is done with it.
+ **/
+typedef struct ClientFrame {
+  size_t refs;
+  size_t len;
+  /* which of client_pool's free lists it goes back to, or -1 for none */
+  int size_class;
+  struct ClientFrame *pool_next;
+  char data[];
+} ClientFrame;
+
 typedef struct ClientResponse {
   struct ClientResponse *next;
   /* used during ClientPhase_HttpResponding to decide where
@@ -18,6 +63,13 @@ typedef struct ClientResponse {
   /* response data goes in here */
   char *buf;
   size_t buf_len, progress;
+
+  /* if set, buf points into this and we don't own it */
+  ClientFrame *frame;
+  /* if set, buf is one of the responses made on startup, nobody's to free */
+  bool shared;
+  /* a point going out to the whole room, fine to drop if they fall behind */
+  bool broadcast;
 } ClientResponse;
 
 /**
@@ -25,6 +77,50 @@ typedef struct ClientResponse {
  * we drop the client.
  **/
 #define MAX_MESSAGE_SIZE (1 << 13)
+
+/**
+ * How much we can recv() in one go. Twice the biggest message,
+ * so there's always room to finish one that's half in already.
+ **/
+#define CLIENT_RECV_SIZE (2 * MAX_MESSAGE_SIZE)
+
+/**
+ * Plain HTTP connections stay open for more requests (HTTP/1.1 unless
+ * they say close, HTTP/1.0 if they ask for keep-alive). In between
+ * requests they can sit quiet for this long; once a request has
+ * started coming in it has to be all there within
+ * CLIENT_HTTP_TIMEOUT_MS, same as the first one. After this many, we
+ * close it anyway.
+ **/
+#define CLIENT_HTTP_KEEPALIVE_S 5
+#define CLIENT_HTTP_KEEPALIVE_MAX 100
+
+/**
+ * A request has this long to finish coming in, counted from its first
+ * byte (from the accept, for the first one) however slowly the rest
+ * trickles in, and a response has CLIENT_HTTP_KEEPALIVE_S to make some
+ * progress going out.
+ **/
+#define CLIENT_HTTP_TIMEOUT_MS 2000
+
+/**
+ * A websocket we haven't heard from in this long gets pinged, and if
+ * there's still nothing back (not even the pong) this long after
+ * that, it's gone.
+ **/
+#define CLIENT_WS_PING_MS 2000
+#define CLIENT_WS_PONG_MS 10000
+
+/**
+ * A websocket client that can't keep up with a busy room has points
+ * piling up in its response queue. Once this many bytes of them are
+ * waiting, they're all thrown out and nothing more goes out to that
+ * client until the queue drains down to the low mark; then it gets
+ * the room over again, from scratch, with one fresh history snapshot.
+ **/
+#define CLIENT_WS_QUEUE_HIGH (1 << 20)
+#define CLIENT_WS_QUEUE_LOW  (64 << 10)
+
 typedef struct Client {
   struct Client *next;
 
@@ -33,33 +129,138 @@ typedef struct Client {
   size_t id;
   int net_fd; /* net fd from accept() */
 
-  /* used for dropping clients that aren't doing anything */
-  time_t last_activity, last_ping;
+  /* our registration with the server's event loop */
+  EventSource ev;
+
+  /* used for dropping clients that aren't doing anything, event_now_ms() */
+  long long last_activity, last_ping;
+  /* when they last sent us anything at all, a pong included */
+  long long last_heard;
+
+  /* the server keeps everyone with a deadline on a timing wheel */
+  long long wheel_at;
+  struct Client *wheel_next, **wheel_pprev;
+
+  ClientWsFormat ws_format;
+  /* negotiated permessage-deflate */
+  bool ws_deflate;
+  /* they sent a close, ours goes out and then we hang up */
+  bool ws_closing;
+  /* we dropped points on them, they need the room again once they drain */
+  bool ws_resync;
+  /* the <room> from /chat/<room>, empty for plain /chat */
+  char ws_room[CLIENT_WS_ROOM_MAX + 1];
+  /**
+   * What part of the canvas they can see, in canvas pixels, from
+   * /chat?view=x0,y0,x1,y1 (or a "view x0, y0, x1, y1" message later).
+   * Until it's set, they get sent everything.
+   **/
+  struct {
+    bool set;
+    int x0, y0, x1, y1;
+  } ws_view;
+
+  /* the server keeps track of who's in which room with these */
+  struct ServerRoom *room;
+  struct Client *room_prev, *room_next;
+  /* points waiting for them alone, if they have a view and we coalesce */
+  struct ServerBatch *view_batch;
+
+  /**
+   * Everything we read off the socket lands in here first, in big
+   * recv()s, and the parsers pick whole requests and frames out of
+   * [start, end). Unparsed bytes get moved to the front when we run
+   * out of room at the back.
+   **/
+  struct {
+    size_t start, end;
+    char buf[CLIENT_RECV_SIZE];
+  } recv;
 
   /* requesting */
   struct {
-    FILE *file; /* closed after requesting */
     bool seen_linefeed;
+    /* how far past recv.start we've looked for the blank line */
     size_t bytes_read;
-
-    /* request data goes in here when file is closed */
-    char *buf;
-    size_t buf_len;
+    /* when this request started coming in, and 0 while a kept alive
+     * connection waits for the next one; more bytes don't move it */
+    long long started;
   } http_req;
+  /* how many requests have been answered on this connection */
+  size_t http_requests;
 
   struct {
-    size_t progress;
-
-    uint8_t fin, opcode, has_mask, payload_len, mask[4];
+    /* whole frame, header included, so we know what to skip */
+    size_t frame_len;
+
+    /* rsv1 means the payload came in compressed */
+    uint8_t fin, rsv1, opcode, has_mask, mask[4];
+    size_t payload_len;
+    /* unmasked in place, points into recv.buf,
+     * or into the shared inflate buffer if it was compressed */
     char *payload;
   } ws_req;
 
+  /**
+   * A message that's coming in over several frames. What we have of
+   * it so far sits at recv.start, unmasked, with the frame headers in
+   * between squeezed out; the frames after it are parsed from there.
+   **/
+  struct {
+    /* 0 if we're not in the middle of one */
+    uint8_t opcode, rsv1;
+    size_t len;
+  } ws_msg;
+
   ClientResponse res;
+  /* the last one in res's chain, which might be res itself */
+  ClientResponse *res_tail;
+  /* how much of the chain is still to be written, all of it and
+   * just the broadcasts */
+  size_t res_bytes, res_broadcast_bytes;
 
 } Client;
 
 static void client_init(Client *c, int net_fd, size_t client_id);
 
+/**
+ * Everything a broadcast makes and throws away again (frames, and the
+ * responses that hold them in clients' queues) comes off free lists
+ * instead of the heap, and so do Clients, which are mostly their
+ * recv buffer. The lists are per thread, like the zlib streams.
+ *
+ * Frames come in power of two size classes, from 64 bytes up to
+ * 32K; bigger ones (a room's whole history) are malloc'd each time,
+ * but those are cached anyway. Each list hangs on to at most so many
+ * spares, and gives the rest back.
+ **/
+#define CLIENT_FRAME_CLASS_MIN 6
+#define CLIENT_FRAME_CLASS_COUNT 10
+#define CLIENT_POOL_FRAMES_KEEP 64
+#define CLIENT_POOL_RES_KEEP 4096
+#define CLIENT_POOL_CLIENTS_KEEP 64
+
+/**
+ * How many times each list came up empty and had to go to malloc,
+ * since the thread started. Once things are warmed up these should
+ * stop moving, no matter how many points are going out.
+ **/
+typedef struct {
+  size_t frames, responses, clients;
+} ClientPoolMisses;
+
+/* these are client_init'd already */
+static Client *client_new(int net_fd, size_t client_id);
+static void client_release(Client *c);
+/* zeroed */
+static ClientResponse *client_res_new(void);
+static void client_res_release(ClientResponse *r);
+/* lets go of whatever r->buf is, however it's owned */
+static void client_res_free_buf(ClientResponse *r);
+static ClientPoolMisses client_pool_misses(void);
+/* gives all the spares back, for when the thread is done */
+static void client_pool_free(void);
+
 /**
  * Tells hte server which events are worth waking up for.
  * Important not to subscribe to an event you don't handle,
@@ -68,6 +269,10 @@ static void client_init(Client *c, int net_fd, size_t client_id);
  **/
 static short client_events_subscription(Client *c);
 
+/**
+ * WsMessageReady only ever means a text or binary message; pings,
+ * pongs and closes are all dealt with in here.
+ **/
 typedef enum {
   ClientStepResult_Error,
   ClientStepResult_NoAction,
@@ -76,14 +281,86 @@ typedef enum {
 } ClientStepResult;
 static ClientStepResult client_step(Client *c);
 
+/**
+ * When client_step next has something to do even if nothing happens
+ * on the socket (a timeout, a ping), in event_now_ms() time; 0 if
+ * there's nothing like that coming up.
+ **/
+static long long client_deadline(Client *c);
+
 static void client_drop(Client *c);
 
+/**
+ * One big recv() into c->recv. Returns how many bytes came in,
+ * 0 if there's nothing right now, and -1 if the client is gone.
+ **/
+static int client_recv_fill(Client *c);
+
+/**
+ * Sends as much of the queued responses as the socket will take,
+ * the whole chain at once with a single writev. Keeps going until
+ * the socket pushes back, because with an edge-triggered event loop
+ * we won't be told about it again.
+ *
+ * Returns -1 on error, 0 if the socket pushed back
+ * and 1 once everything queued has been sent.
+ **/
+static int client_write_res(Client *c);
+
+/**
+ * Puts together the responses that are the same for everyone (the
+ * page, gzipped and not, and the 304 and 404), the first time it's
+ * called; every thread after that just shares them.
+ **/
+static void client_http_init(void);
 static int client_http_respond_to_request(Client *c);
-static void client_ws_send_text(
-  Client *c,
-  char *text,
-  size_t text_len
+
+/* call once the server is done with the frame in c->ws_req */
+static void client_ws_req_done(Client *c);
+
+/* these come back with one reference, which belongs to the caller */
+static ClientFrame *client_frame_new(size_t len);
+static ClientFrame *client_ws_frame(
+  uint8_t opcode,
+  const void *payload,
+  size_t payload_len
+);
+
+/**
+ * writes a final frame's header into out, returns how long it was.
+ * `deflated` marks the payload as compressed with client_ws_deflate.
+ **/
+static size_t client_ws_header(
+  uint8_t *out,
+  uint8_t opcode,
+  bool deflated,
+  size_t payload_len
+);
+
+/* the shared permessage-deflate streams */
+static int client_ws_zlib_init(void);
+static void client_ws_zlib_free(void);
+
+/**
+ * Compresses one whole message for a permessage-deflate frame.
+ * Returns how much went into out, or 0 if it didn't fit.
+ **/
+static size_t client_ws_deflate(
+  const void *in,
+  size_t in_len,
+  void *out,
+  size_t out_cap
 );
+/* 1 for text, 2 for binary */
+static uint8_t client_ws_format_opcode(ClientWsFormat format);
+static void client_frame_unref(ClientFrame *f);
+/* queues the frame up, taking a reference of its own */
+static void client_ws_send_frame(Client *c, ClientFrame *f);
+/**
+ * Same, for a point going out to the whole room, unless they're too far
+ * behind for it (see CLIENT_WS_QUEUE_HIGH). False if it was dropped.
+ **/
+static bool client_ws_send_broadcast(Client *c, ClientFrame *f);
 
 #endif
 
@@ -97,25 +374,152 @@ static void client_ws_send_text(
 static void client_init(Client *c, int net_fd, size_t client_id) {
   *c = (Client) {
     .id = client_id,
-    .last_activity = time(NULL),
-    .last_ping = time(NULL),
+    .last_activity = event_now_ms(),
+    .http_req.started = event_now_ms(),
+    .last_ping = event_now_ms(),
+    .last_heard = event_now_ms(),
     .phase = ClientPhase_HttpRequesting,
     .net_fd = net_fd,
+    .ev = { .fd = net_fd, .udata = c },
+    .res_tail = &c->res,
   };
-  c->http_req.file = open_memstream(
-    &c->http_req.buf,
-    &c->http_req.buf_len
-  );
 }
 
-static void client_drop(Client *c) {
-  if (c->phase == ClientPhase_HttpRequesting) {
-    if (c->http_req.file != NULL)
-      fclose(c->http_req.file);
-    if (c->http_req.buf != NULL)
-      free(c->http_req.buf);
+static _Thread_local struct {
+  ClientFrame *frames[CLIENT_FRAME_CLASS_COUNT];
+  size_t frame_count[CLIENT_FRAME_CLASS_COUNT];
+
+  /* these two are strung together through their own `next` */
+  ClientResponse *res;
+  size_t res_count;
+  Client *clients;
+  size_t client_count;
+
+  ClientPoolMisses misses;
+} client_pool;
+
+static Client *client_new(int net_fd, size_t client_id) {
+  Client *c = client_pool.clients;
+  if (c) {
+    client_pool.clients = c->next;
+    client_pool.client_count--;
+  } else {
+    c = malloc(sizeof(Client));
+    client_pool.misses.clients++;
+  }
+
+  client_init(c, net_fd, client_id);
+  return c;
+}
+
+static void client_release(Client *c) {
+  if (client_pool.client_count == CLIENT_POOL_CLIENTS_KEEP) {
+    free(c);
+    return;
+  }
+
+  c->next = client_pool.clients;
+  client_pool.clients = c;
+  client_pool.client_count++;
+}
+
+static ClientResponse *client_res_new(void) {
+  ClientResponse *r = client_pool.res;
+  if (r) {
+    client_pool.res = r->next;
+    client_pool.res_count--;
+  } else {
+    r = malloc(sizeof(ClientResponse));
+    client_pool.misses.responses++;
+  }
+
+  memset(r, 0, sizeof(*r));
+  return r;
+}
+
+static void client_res_release(ClientResponse *r) {
+  if (client_pool.res_count == CLIENT_POOL_RES_KEEP) {
+    free(r);
+    return;
+  }
+
+  r->next = client_pool.res;
+  client_pool.res = r;
+  client_pool.res_count++;
+}
+
+static ClientFrame *client_frame_new(size_t len) {
+  int size_class = 0;
+  while (size_class < CLIENT_FRAME_CLASS_COUNT &&
+         len > (size_t)1 << (CLIENT_FRAME_CLASS_MIN + size_class))
+    size_class++;
+
+  ClientFrame *f = NULL;
+  if (size_class == CLIENT_FRAME_CLASS_COUNT) {
+    f = malloc(sizeof(ClientFrame) + len);
+    size_class = -1;
+  } else if (client_pool.frames[size_class]) {
+    f = client_pool.frames[size_class];
+    client_pool.frames[size_class] = f->pool_next;
+    client_pool.frame_count[size_class]--;
+  } else {
+    f = malloc(
+      sizeof(ClientFrame) + ((size_t)1 << (CLIENT_FRAME_CLASS_MIN + size_class))
+    );
+    client_pool.misses.frames++;
+  }
+
+  f->refs = 1;
+  f->len = len;
+  f->size_class = size_class;
+  return f;
+}
+
+static void client_frame_unref(ClientFrame *f) {
+  if (--f->refs > 0) return;
+
+  int size_class = f->size_class;
+  if (size_class < 0 ||
+      client_pool.frame_count[size_class] == CLIENT_POOL_FRAMES_KEEP) {
+    free(f);
+    return;
+  }
+
+  f->pool_next = client_pool.frames[size_class];
+  client_pool.frames[size_class] = f;
+  client_pool.frame_count[size_class]++;
+}
+
+static ClientPoolMisses client_pool_misses(void) {
+  return client_pool.misses;
+}
+
+static void client_pool_free(void) {
+  for (int i = 0; i < CLIENT_FRAME_CLASS_COUNT; i++)
+    for (ClientFrame *next = NULL, *f = client_pool.frames[i]; f; f = next) {
+      next = f->pool_next;
+      free(f);
+    }
+
+  for (ClientResponse *next = NULL, *r = client_pool.res; r; r = next) {
+    next = r->next;
+    free(r);
+  }
+
+  for (Client *next = NULL, *c = client_pool.clients; c; c = next) {
+    next = c->next;
+    free(c);
   }
 
+  memset(&client_pool, 0, sizeof(client_pool));
+}
+
+static void client_res_free_buf(ClientResponse *r) {
+  if      (r->frame)  client_frame_unref(r->frame);
+  else if (!r->shared) free(r->buf);
+}
+
+static void client_drop(Client *c) {
   c->phase = ClientPhase_Empty;
 
   /* free any lingering queued ClientResponses */
@@ -127,17 +531,111 @@ static void client_drop(Client *c) {
       last = next
     ) {
       next = last->next;
-      free(last->buf);
-      free(last);
+      client_res_free_buf(last);
+      client_res_release(last);
     }
   }
 
-  if (c->  ws_req.payload != NULL) free(c->ws_req.payload);
-  if (c->     res.buf     != NULL) free(c->res.buf);
+  client_res_free_buf(&c->res);
 
   close(c->net_fd);
 }
 
+static int client_recv_fill(Client *c) {
+  /* out of room at the back, move what's left to the front */
+  if (c->recv.end == CLIENT_RECV_SIZE) {
+    memmove(
+      c->recv.buf,
+      c->recv.buf + c->recv.start,
+      c->recv.end - c->recv.start
+    );
+    c->recv.end -= c->recv.start;
+    c->recv.start = 0;
+
+    /* nobody's consuming, so whatever this is, it's too big */
+    if (c->recv.end == CLIENT_RECV_SIZE) return -1;
+  }
+
+  ssize_t read_ret = event_recv(
+    &c->ev,
+    c->recv.buf + c->recv.end,
+    CLIENT_RECV_SIZE - c->recv.end
+  );
+  if (read_ret == 0) return -1; /* hung up */
+  if (read_ret < 0) {
+    if (errno == EWOULDBLOCK || errno == EAGAIN)
+      return 0;
+    perror("client recv()");
+    return -1;
+  }
+
+  c->recv.end += read_ret;
+  metrics_add(&metrics_local->bytes_received, read_ret);
+  c->last_activity = c->last_heard = event_now_ms();
+  if (c->phase == ClientPhase_HttpRequesting && c->http_req.started == 0)
+    c->http_req.started = c->last_activity;
+  return read_ret;
+}
+
+/* how many queued responses we hand to a single writev */
+#define CLIENT_WRITE_IOV_MAX 64
+static int client_write_res(Client *c) {
+  while (c->res.buf_len > 0) {
+    struct iovec iov[CLIENT_WRITE_IOV_MAX];
+    int iov_count = 0;
+    for (
+      ClientResponse *r = &c->res;
+      r && iov_count < CLIENT_WRITE_IOV_MAX;
+      r = r->next
+    ) {
+      if (r->progress == r->buf_len) continue;
+      iov[iov_count++] = (struct iovec) {
+        .iov_base = r->buf     + r->progress,
+        .iov_len  = r->buf_len - r->progress,
+      };
+    }
+
+    ssize_t wlen = event_sendv(&c->ev, iov, iov_count);
+    if (wlen < 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN)
+        return 0;
+      perror("client writev()");
+      return -1;
+    }
+
+    c->last_activity = event_now_ms();
+    c->res_bytes -= wlen;
+    metrics_add(&metrics_local->bytes_sent, wlen);
+
+    /* walk what got written off the front of the chain;
+     * c->res.progress is how far into the head we've gotten */
+    size_t written = wlen;
+    while (written > 0) {
+      size_t left = c->res.buf_len - c->res.progress;
+      if (written < left) {
+        c->res.progress += written;
+        break;
+      }
+      written -= left;
+
+      ClientResponse *next = c->res.next;
+      if (c->res.broadcast) c->res_broadcast_bytes -= c->res.buf_len;
+
+      /* done writing, we can reset response */
+      client_res_free_buf(&c->res);
+      memset(&c->res, 0, sizeof(c->res));
+
+      if (next) {
+        c->res = *next;
+        client_res_release(next);
+        if (c->res_tail == next) c->res_tail = &c->res;
+      }
+    }
+  }
+
+  return 1;
+}
+
 static short client_events_subscription(Client *c) {
   short events = 0;
   short events_writes = POLLWRNORM | POLLWRBAND          ;
@@ -149,10 +647,10 @@ static short client_events_subscription(Client *c) {
       fprintf(stderr, "empty client!?\n");
     } break;
     case ClientPhase_HttpRequesting: {
-      events = events_writes;
+      events = events_reads;
     } break;
     case ClientPhase_HttpResponding: {
-      events = events_reads;
+      events = events_writes;
     } break;
     case ClientPhase_Websocket: {
       events = events_reads;
@@ -163,17 +661,41 @@ static short client_events_subscription(Client *c) {
   return events;
 }
 
-static ClientStepResult client_step(Client *c) {
+static long long client_deadline(Client *c) {
+  switch (c->phase) {
+
+    case ClientPhase_Empty:
+      return 0;
+
+    case ClientPhase_HttpRequesting:
+      /* longer if they're kept alive and in between requests */
+      if (c->http_req.started == 0)
+        return c->last_activity + CLIENT_HTTP_KEEPALIVE_S * 1000;
+      return c->http_req.started + CLIENT_HTTP_TIMEOUT_MS;
 
-  if ((c->phase == ClientPhase_HttpRequesting) ||
-      (c->phase == ClientPhase_HttpRequesting)) {
-    long int time_since_io = time(NULL) - c->last_activity;
+    case ClientPhase_HttpResponding:
+      return c->last_activity + CLIENT_HTTP_KEEPALIVE_S * 1000;
+
+    case ClientPhase_Websocket: {
+      /* one ping at a time, until they answer it they're overdue */
+      if (c->last_ping > c->last_heard)
+        return c->last_ping + CLIENT_WS_PONG_MS;
+      return c->last_heard + CLIENT_WS_PING_MS;
+    }
 
-    /* timeout */
-    if (time_since_io > 1)
-      return ClientStepResult_Error;
   }
 
+  return 0;
+}
+
+static ClientStepResult client_step(Client *c) {
+
+  /* timeout */
+  long long deadline = client_deadline(c);
+  if (c->phase != ClientPhase_Websocket &&
+      deadline && event_now_ms() >= deadline)
+    return ClientStepResult_Error;
+
   switch (c->phase) {
 
     case ClientPhase_Empty:
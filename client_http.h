@@ -15,7 +15,18 @@
 "  <body>\r\n" \
 "    <canvas id='pagecanvas'></canvas>\r\n" \
 "    <script>'use strict'; (async () => {\r\n" \
-"const ws = new WebSocket(window.location.href.replace(/\\/$/, '') + '/chat');\r\n" \
+"/* page.html#<room> draws on its own canvas, just page.html on the shared one */\r\n" \
+"const room = window.location.hash.slice(1);\r\n" \
+"window.onhashchange = () => window.location.reload();\r\n" \
+"\r\n" \
+"/* no ?view=, since we can't pan: asking for everything lets the server\r\n" \
+" * send us the same snapshot and batches it sends everyone else */\r\n" \
+"const ws = new WebSocket(\r\n" \
+"  window.location.href.replace(/#.*$/, '').replace(/\\/$/, '') + '/chat' +\r\n" \
+"    (room ? '/' + encodeURIComponent(room) : ''),\r\n" \
+"  ['cketchbook.bin']\r\n" \
+");\r\n" \
+"ws.binaryType = 'arraybuffer';\r\n" \
 "await new Promise(res => ws.onopen = res);\r\n" \
 "\r\n" \
 "const canvas = document.getElementById('pagecanvas');\r\n" \
@@ -32,26 +43,57 @@
 "  local_paths: [],\r\n" \
 "  server_paths: new Map(),\r\n" \
 "};\r\n" \
-"ws.onmessage = msg => {\r\n" \
-"  const [action, user_id, path_id, x, y] = msg\r\n" \
-"    .data\r\n" \
-"    .split(', ')\r\n" \
-"    .map(x => parseInt(x));\r\n" \
+"function on_point(action, user_id, path_id, x, y, seq) {\r\n" \
+"  /* everything older than seq is gone, and paths are kept oldest first */\r\n" \
+"  if (action == 3) {\r\n" \
+"    for (const [path_hash, path] of input.server_paths) {\r\n" \
+"      let old = 0;\r\n" \
+"      while (old < path.length && path[old].seq < seq) old++;\r\n" \
+"      if (old == path.length) input.server_paths.delete(path_hash);\r\n" \
+"      else if (old) path.splice(0, old);\r\n" \
+"    }\r\n" \
+"    return;\r\n" \
+"  }\r\n" \
+"\r\n" \
 "  const path_hash = user_id + '_' + path_id;\r\n" \
 "  if (!input.server_paths.has(path_hash))\r\n" \
 "    input.server_paths.set(path_hash, []);\r\n" \
-"  if (action == 1) input.server_paths.get(path_hash).push({ x, y });\r\n" \
-"  else if (action == 2) {\r\n" \
-"    input.server_paths.set(\r\n" \
-"      path_hash,\r\n" \
-"      input\r\n" \
-"        .server_paths\r\n" \
-"        .get(path_hash)\r\n" \
-"        .filter(p => {\r\n" \
-"          const delta = Math.sqrt((p.x - x)*(p.x - x) + (p.y - y)*(p.y - y));\r\n" \
-"          return delta > 1;\r\n" \
-"        })\r\n" \
-"    );\r\n" \
+"  const path = input.server_paths.get(path_hash);\r\n" \
+"\r\n" \
+"  /* where it goes in seq order; usually the end, but not always\r\n" \
+"   * (like when a resync sends the room over again) */\r\n" \
+"  let lo = 0, hi = path.length;\r\n" \
+"  while (lo < hi) {\r\n" \
+"    const mid = (lo + hi) >> 1;\r\n" \
+"    if (path[mid].seq < seq) lo = mid + 1;\r\n" \
+"    else hi = mid;\r\n" \
+"  }\r\n" \
+"  const here = lo < path.length && path[lo].seq == seq;\r\n" \
+"  if (action == 1 && !here) path.splice(lo, 0, { x, y, seq });\r\n" \
+"  else if (action == 2 && here) path.splice(lo, 1);\r\n" \
+"}\r\n" \
+"ws.onmessage = msg => {\r\n" \
+"  if (msg.data instanceof ArrayBuffer) {\r\n" \
+"    /* u8 action, u32 user id, u32 path id, i16 x, i16 y, u32 seq; little endian */\r\n" \
+"    const view = new DataView(msg.data);\r\n" \
+"    for (let i = 0; i + 17 <= view.byteLength; i += 17)\r\n" \
+"      on_point(\r\n" \
+"        view.getUint8(i),\r\n" \
+"        view.getUint32(i + 1, true),\r\n" \
+"        view.getUint32(i + 5, true),\r\n" \
+"        view.getInt16(i + 9, true),\r\n" \
+"        view.getInt16(i + 11, true),\r\n" \
+"        view.getUint32(i + 13, true)\r\n" \
+"      );\r\n" \
+"    return;\r\n" \
+"  }\r\n" \
+"\r\n" \
+"  /* one point per line, a batch may hold several */\r\n" \
+"  for (const line of msg.data.split('\\n')) {\r\n" \
+"    const [action, user_id, path_id, x, y, seq] = line\r\n" \
+"      .split(', ')\r\n" \
+"      .map(x => parseInt(x));\r\n" \
+"    on_point(action, user_id, path_id, x, y, seq);\r\n" \
 "  }\r\n" \
 "};\r\n" \
 "\r\n" \
@@ -70,13 +112,22 @@
 "  const x = ev.clientX * window.devicePixelRatio;\r\n" \
 "  const y = ev.clientY * window.devicePixelRatio;\r\n" \
 "  input.local_paths.at(-1).push({ x, y });\r\n" \
-"  ws.send(\r\n" \
-"    (input.local_paths.length - 1) +\r\n" \
-"      ', ' +\r\n" \
-"      x.toFixed(0) +\r\n" \
-"      ', ' +\r\n" \
-"      y.toFixed(0)\r\n" \
-"  );\r\n" \
+"  if (ws.protocol == 'cketchbook.bin') {\r\n" \
+"    /* u32 path id, i16 x, i16 y; little endian */\r\n" \
+"    const view = new DataView(new ArrayBuffer(8));\r\n" \
+"    view.setUint32(0, input.local_paths.length - 1, true);\r\n" \
+"    view.setInt16(4, Math.round(x), true);\r\n" \
+"    view.setInt16(6, Math.round(y), true);\r\n" \
+"    ws.send(view.buffer);\r\n" \
+"  } else {\r\n" \
+"    ws.send(\r\n" \
+"      (input.local_paths.length - 1) +\r\n" \
+"        ', ' +\r\n" \
+"        x.toFixed(0) +\r\n" \
+"        ', ' +\r\n" \
+"        y.toFixed(0)\r\n" \
+"    );\r\n" \
+"  }\r\n" \
 "}\r\n" \
 "\r\n" \
 "requestAnimationFrame(function render(now) {\r\n" \
@@ -110,30 +161,363 @@
 "  </body>\r\n" \
 "</html>\r\n"
 
+/* is `token` one of the items in a comma separated header value? */
+static bool client_http_header_has_token(const char *value, const char *token) {
+  size_t token_len = strlen(token);
+
+  for (const char *p = value; *p; ) {
+    while (*p == ' ' || *p == ',') p++;
+
+    size_t len = strcspn(p, ", ");
+    if (len == token_len && strncmp(p, token, len) == 0)
+      return true;
+    p += len;
+  }
+
+  return false;
+}
+
+/**
+ * Is there a permessage-deflate offer in this Sec-WebSocket-Extensions
+ * value we can take? We always compress with a full size window, so
+ * offers that want the server's window smaller are passed over.
+ **/
+static bool client_http_offers_deflate(const char *value) {
+  for (const char *p = value; *p; ) {
+    while (*p == ' ' || *p == ',') p++;
+
+    /* one offer runs up to the next comma, its params split by ';' */
+    size_t offer_len = strcspn(p, ",");
+    size_t name_len = strcspn(p, ",; ");
+    const char *name = "permessage-deflate";
+
+    bool ok = name_len == strlen(name) && strncmp(p, name, name_len) == 0;
+    for (const char *q = p; ok && q < p + offer_len; q++)
+      if (strncmp(q, "server_max_window_bits", 22) == 0)
+        ok = strncmp(q + 22, "=15", 3) == 0;
+
+    if (ok) return true;
+    p += offer_len;
+  }
+
+  return false;
+}
+
+/* does this Accept-Encoding value take `coding`, at any q but 0? */
+static bool client_http_accepts_encoding(const char *value, const char *coding) {
+  size_t coding_len = strlen(coding);
+
+  for (const char *p = value; *p; ) {
+    while (*p == ' ' || *p == ',') p++;
+
+    /* one coding runs up to the next comma, with its q after a ';' */
+    size_t item_len = strcspn(p, ",");
+    size_t name_len = strcspn(p, ",; ");
+
+    if (name_len == coding_len && strncmp(p, coding, name_len) == 0) {
+      const char *q = p + name_len;
+      while (q < p + item_len && (*q == ' ' || *q == ';')) q++;
+      if (strncmp(q, "q=0", 3) != 0) return true;
+      /* q=0.5 is still a yes */
+      for (q += 3; q < p + item_len && (*q == '.' || *q == '0'); q++);
+      if (q < p + item_len && *q >= '1' && *q <= '9') return true;
+    }
+    p += item_len;
+  }
+
+  return false;
+}
+
+#define CLIENT_HTTP_STR_(x) #x
+#define CLIENT_HTTP_STR(x) CLIENT_HTTP_STR_(x)
+
+typedef enum {
+  ClientHttpShared_Page,
+  ClientHttpShared_PageGzip,
+  ClientHttpShared_NotModified,
+  ClientHttpShared_NotFound,
+  ClientHttpShared_COUNT,
+} ClientHttpShared;
+
+/**
+ * Made once by client_http_init and never touched again, so every
+ * thread can send straight out of them. The ETag is weak so both
+ * encodings of the page can share it.
+ **/
+static struct {
+  char etag[32];
+  /* each one a second time for connections we're keeping alive */
+  struct {
+    char *buf;
+    size_t len;
+  } res[ClientHttpShared_COUNT][2];
+} client_http_shared;
+static pthread_once_t client_http_shared_once = PTHREAD_ONCE_INIT;
+
+/* the whole page gzipped, NULL if zlib wasn't having it */
+static char *client_http_gzip(const char *in, size_t in_len, size_t *out_len) {
+  z_stream zs = {0};
+  /* +16 on the window bits gets a gzip header and trailer */
+  if (deflateInit2(
+    &zs,
+    Z_BEST_COMPRESSION,
+    Z_DEFLATED,
+    15 + 16,
+    8,
+    Z_DEFAULT_STRATEGY
+  ) != Z_OK)
+    return NULL;
+
+  size_t cap = deflateBound(&zs, in_len);
+  char *out = malloc(cap);
+  zs.next_in = (Bytef *)in;
+  zs.avail_in = in_len;
+  zs.next_out = (Bytef *)out;
+  zs.avail_out = cap;
+
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&zs);
+    free(out);
+    return NULL;
+  }
+
+  *out_len = cap - zs.avail_out;
+  deflateEnd(&zs);
+  return out;
+}
+
+/* the Connection header, and Keep-Alive's if it is, by keep_alive */
+static const char *client_http_connection[2] = {
+  "Connection: close\r\n",
+  "Connection: keep-alive\r\n"
+  "Keep-Alive: timeout=" CLIENT_HTTP_STR(CLIENT_HTTP_KEEPALIVE_S) "\r\n",
+};
+
+static void client_http_shared_make(void) {
+  const char *page = HTML_RES;
+  size_t page_len = sizeof(HTML_RES) - 1;
+
+  snprintf(
+    client_http_shared.etag,
+    sizeof(client_http_shared.etag),
+    "W/\"%08lx\"",
+    crc32(0, (const Bytef *)page, page_len)
+  );
+
+  size_t gzip_len = 0;
+  char *gzip = client_http_gzip(page, page_len, &gzip_len);
+
+  for (int keep_alive = 0; keep_alive < 2; keep_alive++) {
+    const char *connection = client_http_connection[keep_alive];
+
+    /* what goes on every answer to a GET / */
+    char page_headers[256];
+    snprintf(
+      page_headers,
+      sizeof(page_headers),
+      "ETag: %s\r\n"
+      "Cache-Control: no-cache\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "%s",
+      client_http_shared.etag,
+      connection
+    );
+
+    for (int i = 0; i < ClientHttpShared_COUNT; i++) {
+      FILE *tmp = open_memstream(
+        &client_http_shared.res[i][keep_alive].buf,
+        &client_http_shared.res[i][keep_alive].len
+      );
+
+      switch ((ClientHttpShared)i) {
+        case ClientHttpShared_Page: {
+          fprintf(tmp, "HTTP/1.1 200 OK\r\n");
+          fprintf(tmp, "Content-Type: text/html; charset=iso-8859-1\r\n");
+          fprintf(tmp, "Content-Length: %zu\r\n", page_len);
+          fprintf(tmp, "%s\r\n", page_headers);
+          fwrite(page, 1, page_len, tmp);
+        } break;
+
+        /* if it couldn't be gzipped, it's just the page again */
+        case ClientHttpShared_PageGzip: {
+          fprintf(tmp, "HTTP/1.1 200 OK\r\n");
+          fprintf(tmp, "Content-Type: text/html; charset=iso-8859-1\r\n");
+          if (gzip) fprintf(tmp, "Content-Encoding: gzip\r\n");
+          fprintf(tmp, "Content-Length: %zu\r\n", gzip ? gzip_len : page_len);
+          fprintf(tmp, "%s\r\n", page_headers);
+          fwrite(gzip ? gzip : page, 1, gzip ? gzip_len : page_len, tmp);
+        } break;
+
+        case ClientHttpShared_NotModified: {
+          fprintf(tmp, "HTTP/1.1 304 Not Modified\r\n");
+          fprintf(tmp, "%s\r\n", page_headers);
+        } break;
+
+        case ClientHttpShared_NotFound: {
+          fprintf(tmp, "HTTP/1.1 404 Not Found\r\n");
+          fprintf(tmp, "Content-Length: 0\r\n");
+          fprintf(tmp, "%s\r\n", connection);
+        } break;
+
+        case ClientHttpShared_COUNT: break;
+      }
+
+      fclose(tmp);
+    }
+  }
+
+  free(gzip);
+}
+
+static void client_http_init(void) {
+  pthread_once(&client_http_shared_once, client_http_shared_make);
+}
+
+static void client_http_respond_shared(
+  Client *c,
+  ClientHttpShared which,
+  bool keep_alive
+) {
+  c->res.buf = client_http_shared.res[which][keep_alive].buf;
+  c->res.buf_len = client_http_shared.res[which][keep_alive].len;
+  c->res.shared = true;
+  if (keep_alive) c->res.phase_after_http = ClientPhase_HttpRequesting;
+}
+
+/* GET /metrics, for Prometheus; unlike the rest, made fresh every time */
+static void client_http_respond_metrics(Client *c, bool keep_alive) {
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *tmp = open_memstream(&body, &body_len);
+  metrics_render(tmp);
+  fclose(tmp);
+
+  tmp = open_memstream(&c->res.buf, &c->res.buf_len);
+  fprintf(tmp, "HTTP/1.1 200 OK\r\n");
+  fprintf(tmp, "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n");
+  fprintf(tmp, "Content-Length: %zu\r\n", body_len);
+  fprintf(tmp, "Cache-Control: no-store\r\n");
+  fprintf(tmp, "%s\r\n", client_http_connection[keep_alive]);
+  fwrite(body, 1, body_len, tmp);
+  fclose(tmp);
+  free(body);
+
+  if (keep_alive) c->res.phase_after_http = ClientPhase_HttpRequesting;
+}
+
+/**
+ * Pulls the room out of a "/chat" or "/chat/<room>" path, and the
+ * viewport out of a "?view=x0,y0,x1,y1" after it, if there is one.
+ * Rooms are kept to what can go in a URL as is (or percent-encoded)
+ * so they're safe to print and compare. Returns false if it's not a
+ * chat path.
+ **/
+static bool client_http_parse_chat_path(Client *c, char *path) {
+  char *room = c->ws_room;
+
+  char *query = strchr(path, '?');
+  if (query) {
+    *query++ = '\0';
+    const char *p = query, *end = query + strlen(query);
+    c->ws_view.set =
+      ascii_expect(&p, end, "view=") &&
+      ascii_scan_int(&p, end, &c->ws_view.x0) && ascii_expect(&p, end, ",") &&
+      ascii_scan_int(&p, end, &c->ws_view.y0) && ascii_expect(&p, end, ",") &&
+      ascii_scan_int(&p, end, &c->ws_view.x1) && ascii_expect(&p, end, ",") &&
+      ascii_scan_int(&p, end, &c->ws_view.y1);
+  }
+
+  if (strcmp(path, "/chat") == 0) {
+    room[0] = '\0';
+    return true;
+  }
+
+  if (strncmp(path, "/chat/", 6) != 0) return false;
+  path += 6;
+
+  size_t len = strspn(
+    path,
+    "abcdefghijklmnopqrstuvwxyz"
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "0123456789-._~%"
+  );
+  if (len == 0 || len > CLIENT_WS_ROOM_MAX || path[len] != '\0') return false;
+
+  memcpy(room, path, len + 1);
+  return true;
+}
+
+/**
+ * If [line, end) is the header `name` (colon and all, in any case),
+ * copies its value into out, cut short if it has to be.
+ **/
+static void client_http_header(
+  const char *line,
+  const char *end,
+  const char *name,
+  char *out,
+  size_t out_cap
+) {
+  if (!ascii_expect_nocase(&line, end, name)) return;
+
+  /* the spaces around it and the \r on the end don't count */
+  ascii_skip_space(&line, end);
+  while (end > line && ascii_is_space(end[-1])) end--;
+
+  size_t len = end - line;
+  if (len >= out_cap) len = out_cap - 1;
+  memcpy(out, line, len);
+  out[len] = '\0';
+}
+
 static int client_http_respond_to_request(Client *c) {
 
-  char path[31] = {0};
+  char path[128] = {0};
   char key[31] = {0};
+  char protocols[128] = {0};
+  char extensions[256] = {0};
+  char if_none_match[128] = {0};
+  char accept_encoding[256] = {0};
+  char connection[64] = {0};
+  bool http11 = false;
   {
-    fclose(c->http_req.file);
-    c->http_req.file = NULL;
+    /* the whole request is sitting in our recv buffer */
+    const char *p = c->recv.buf + c->recv.start;
+    const char *end = p + c->http_req.bytes_read;
 
-    /* cannot fscanf a memstream, can fscanf an fmemopen */
-    /* (can grow a memstream, cannot grow an fmemopen) */
-    FILE *req = fmemopen(c->http_req.buf, c->http_req.buf_len, "r");
+    if (!ascii_expect(&p, end, "GET ")) return -1;
+    size_t path_len = 0;
+    while (p + path_len < end && p[path_len] != ' ' && p[path_len] != '\n')
+      path_len++;
+    if (path_len == 0 || path_len >= sizeof(path)) return -1;
+    memcpy(path, p, path_len);
+    p += path_len;
+    http11 = ascii_expect(&p, end, " HTTP/1.1");
 
-    if (fscanf(req, "GET %30s HTTP/1.1\r\n", path) == 0) {
-      fclose(req);
-      return -1;
-    }
+    /* the rest of the headers, we only care about a couple */
+    for (const char *line = p; line < end;) {
+      const char *eol = memchr(line, '\n', end - line);
+      if (eol == NULL) eol = end;
 
-    while (fscanf(req, "Sec-WebSocket-Key: %30s\r\n", key) <= 0)
-      if (fscanf(req, "%*[^\n]\n") == EOF)
-        break; /* no key found */
+      client_http_header(line, eol, "Sec-WebSocket-Key:", key, sizeof(key));
+      client_http_header(
+        line, eol, "Sec-WebSocket-Protocol:", protocols, sizeof(protocols)
+      );
+      client_http_header(
+        line, eol, "Sec-WebSocket-Extensions:", extensions, sizeof(extensions)
+      );
+      client_http_header(
+        line, eol, "If-None-Match:", if_none_match, sizeof(if_none_match)
+      );
+      client_http_header(
+        line, eol, "Accept-Encoding:", accept_encoding, sizeof(accept_encoding)
+      );
+      client_http_header(
+        line, eol, "Connection:", connection, sizeof(connection)
+      );
 
-    fclose(req);
-    free(c->http_req.buf);
-    c->http_req.buf = NULL;
+      line = eol + 1;
+    }
   }
 #if DEBUG
   fprintf(stderr, "path = \"%s\"\n", path);
@@ -142,18 +526,28 @@ static int client_http_respond_to_request(Client *c) {
   c->phase = ClientPhase_HttpResponding;
   c->res.phase_after_http = ClientPhase_Empty;
 
-  if (strcmp(path, "/") == 0) {
-    FILE *tmp = open_memstream(&c->res.buf, &c->res.buf_len);
-    fprintf(tmp, "HTTP/1.0 200 OK\r\n");
-    fprintf(tmp, "Content-Length: %lu\r\n", strlen(HTML_RES) - 2);
-    fprintf(tmp, "Connection: close\r\n");
-    fprintf(tmp, "Content-Type: text/html; charset=iso-8859-1\r\n");
-    fprintf(tmp, "\r\n");
+  /* Connection's tokens aren't case sensitive */
+  for (char *ch = connection; *ch; ch++)
+    if (*ch >= 'A' && *ch <= 'Z') *ch += 'a' - 'A';
+  bool keep_alive =
+    ++c->http_requests < CLIENT_HTTP_KEEPALIVE_MAX &&
+    (http11 ? !client_http_header_has_token(connection, "close")
+            : client_http_header_has_token(connection, "keep-alive"));
 
-    fprintf(tmp, "%s", HTML_RES);
+  if (strcmp(path, "/") == 0) {
+    /* the quoted part matches with or without the W/ */
+    const char *tag = client_http_shared.etag + 2;
+    bool fresh = strcmp(if_none_match, "*") == 0 || strstr(if_none_match, tag);
 
-    fclose(tmp);
-  } else if (strcmp(path, "/chat") == 0) {
+    ClientHttpShared which = ClientHttpShared_Page;
+    if (fresh)
+      which = ClientHttpShared_NotModified;
+    else if (client_http_accepts_encoding(accept_encoding, "gzip"))
+      which = ClientHttpShared_PageGzip;
+    client_http_respond_shared(c, which, keep_alive);
+  } else if (strcmp(path, "/metrics") == 0) {
+    client_http_respond_metrics(c, keep_alive);
+  } else if (client_http_parse_chat_path(c, path)) {
     FILE *tmp = open_memstream(&c->res.buf, &c->res.buf_len);
     fprintf(tmp, "HTTP/1.1 101 Switching Protocols\r\n");
     fprintf(tmp, "Upgrade: websocket\r\n");
@@ -163,43 +557,52 @@ static int client_http_respond_to_request(Client *c) {
     client_ws_fwrite_sec_accept(tmp, key);
     fprintf(tmp, "\r\n");
 
+    c->ws_format = ClientWsFormat_Text;
+    if (client_http_header_has_token(protocols, CLIENT_WS_PROTOCOL_BINARY)) {
+      c->ws_format = ClientWsFormat_Binary;
+      fprintf(tmp, "Sec-WebSocket-Protocol: " CLIENT_WS_PROTOCOL_BINARY "\r\n");
+    }
+
+    c->ws_deflate = false;
+    if (client_ws_zlib.ready && client_http_offers_deflate(extensions)) {
+      c->ws_deflate = true;
+      fprintf(tmp, "Sec-WebSocket-Extensions: " CLIENT_WS_EXTENSION_DEFLATE "\r\n");
+    }
+
     fprintf(tmp, "\r\n");
 
     fclose(tmp);
     c->res.phase_after_http = ClientPhase_Websocket;
   } else {
-    FILE *tmp = open_memstream(&c->res.buf, &c->res.buf_len);
-    fprintf(tmp, "HTTP/1.1 404 Not Found\r\n\r\n");
-    fclose(tmp);
+    client_http_respond_shared(c, ClientHttpShared_NotFound, keep_alive);
   }
 
+  c->res_bytes = c->res.buf_len;
   return 0;
 }
 
 static ClientStepResult client_http_read_request(Client *c) {
   for (;;) {
-    char byte;
-    int read_ret = read(c->net_fd, &byte, 1);
-    if (read_ret < 1) {
-      if (errno != EWOULDBLOCK && errno != EAGAIN) {
-        perror("client read()");
-        return ClientStepResult_Error;
-      }
-      break;
-    }
-
-    fwrite(&byte, 1, 1, c->http_req.file);
-    c->http_req.bytes_read++;
+    /* pick up looking for the blank line where we left off */
+    while (c->recv.start + c->http_req.bytes_read < c->recv.end) {
+      char byte = c->recv.buf[c->recv.start + c->http_req.bytes_read++];
 
-    if (c->http_req.bytes_read > MAX_MESSAGE_SIZE)
-      return ClientStepResult_Error;
+      /* ignore carriage return */
+      if (byte == 0x0D) continue;
 
-    /* ignore carriage return */
-    if (byte != 0x0D) {
       /* track line feeds */
       if (byte == 0x0A) {
         if (c->http_req.seen_linefeed) {
-          if (client_http_respond_to_request(c) < 0)
+          int ret = client_http_respond_to_request(c);
+
+          /* anything after the request stays buffered for later,
+           * like the next one, if they're pipelining */
+          c->recv.start += c->http_req.bytes_read;
+          if (c->recv.start == c->recv.end)
+            c->recv.start = c->recv.end = 0;
+          memset(&c->http_req, 0, sizeof(c->http_req));
+
+          if (ret < 0)
             return ClientStepResult_Error;
           return ClientStepResult_Restart;
         }
@@ -208,40 +611,33 @@ static ClientStepResult client_http_read_request(Client *c) {
         c->http_req.seen_linefeed = 0;
       }
     }
+
+    if (c->http_req.bytes_read > MAX_MESSAGE_SIZE)
+      return ClientStepResult_Error;
+
+    int filled = client_recv_fill(c);
+    if (filled < 0) return ClientStepResult_Error;
+    if (filled == 0) break;
   }
 
   return ClientStepResult_NoAction;
 }
 
 static ClientStepResult client_http_write_response(Client *c) {
-  while (c->res.progress < c->res.buf_len) {
-    char byte = c->res.buf[c->res.progress];
-    ssize_t wlen = write(c->net_fd, &byte, 1);
-
-    if (wlen < 1) {
-      if (errno != EWOULDBLOCK && errno != EAGAIN) {
-        perror("client write()");
-        return ClientStepResult_Error;
-      }
-      return ClientStepResult_NoAction;
-    }
+  /* client_write_res resets c->res once it's all out */
+  ClientPhase phase_after_http = c->res.phase_after_http;
 
-    /* important to only increase this if write succeeds */
-    c->res.progress += 1;
+  switch (client_write_res(c)) {
+    case -1: return ClientStepResult_Error;
+    case  0: return ClientStepResult_NoAction;
   }
 
-  if (c->res.progress == c->res.buf_len) {
-    if (c->res.phase_after_http == ClientPhase_Empty) {
-      return ClientStepResult_Error;
-    } else {
-      c->phase = c->res.phase_after_http;
-
-      free(c->res.buf);
-      memset(&c->res, 0, sizeof(c->res));
+  if (phase_after_http == ClientPhase_Empty)
+    return ClientStepResult_Error;
 
-      return ClientStepResult_Restart;
-    }
-  }
-
-  return ClientStepResult_NoAction;
+  c->phase = phase_after_http;
+  /* a pipelined request is already on its way in */
+  if (c->phase == ClientPhase_HttpRequesting && c->recv.start != c->recv.end)
+    c->http_req.started = event_now_ms();
+  return ClientStepResult_Restart;
 }
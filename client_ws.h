@@ -1,174 +1,480 @@
 // vim: sw=2 ts=2 expandtab smartindent
 
-static ClientResponse *client_ws_next_res(Client *c) {
-    ClientResponse *r = &c->res;
-
-    for (; r->progress < r->buf_len; r = r->next) {
-      if (r->next == NULL) {
-        r->next = calloc(sizeof(ClientResponse), 1);
-        r = r->next;
-        return r;
-      }
-    }
+/* a free spot at the end of the chain, for `len` more bytes */
+static ClientResponse *client_ws_next_res(Client *c, size_t len) {
+  c->res_bytes += len;
+
+  /* the head is empty only if the whole chain is */
+  if (c->res.buf_len == 0) return &c->res;
 
-    return r;
+  ClientResponse *r = client_res_new();
+  c->res_tail->next = r;
+  c->res_tail = r;
+  return r;
 }
 
-static void client_ws_send_text(
-  Client *c,
-  char *text,
-  size_t text_len
+static uint8_t client_ws_format_opcode(ClientWsFormat format) {
+  return format == ClientWsFormat_Binary ? 2 : 1;
+}
+
+static size_t client_ws_header(
+  uint8_t *out,
+  uint8_t opcode,
+  bool deflated,
+  size_t payload_len
 ) {
-  ClientResponse *res = client_ws_next_res(c);
+  uint8_t fin = 1;
 
-  char *out;
-  size_t out_len;
-  FILE *tmp = open_memstream(&out, &out_len);
-  {
+  out[0] = (fin << 7) | (deflated << 6) | (opcode & 0b1111);
 
-    /* WS frame header */
-    {
-      uint8_t fin = 1;
-      uint8_t opcode = 1;
-      uint8_t byte;
+  if (payload_len < 126) {
+    out[1] = payload_len;
+    return 2;
+  }
 
-      byte = (fin << 7) | (opcode & 0b1111);
-      fwrite(&byte, 1, 1, tmp);
+  /* the extended lengths are big endian */
+  if (payload_len <= 0xFFFF) {
+    out[1] = 126;
+    out[2] = payload_len >> 8;
+    out[3] = payload_len;
+    return 4;
+  }
 
-      byte = 0; /* put in at end with hack */
-      fwrite(&byte, 1, 1, tmp);
-    }
+  out[1] = 127;
+  for (int i = 0; i < 8; i++)
+    out[2 + i] = (uint64_t)payload_len >> (56 - 8*i);
+  return 10;
+}
 
-    fwrite(text, text_len, 1, tmp);
+/**
+ * One deflate and one inflate stream for everybody (on this thread).
+ * Without context takeover each message starts over from nothing, so
+ * there's no per-client state to keep between them, just a reset.
+ **/
+static _Thread_local struct {
+  bool ready;
+  z_stream deflate, inflate;
+  /* where compressed requests get inflated to */
+  char out[MAX_MESSAGE_SIZE];
+} client_ws_zlib;
+
+static int client_ws_zlib_init(void) {
+  /* negative window bits means raw deflate, no zlib header or trailer */
+  if (deflateInit2(
+    &client_ws_zlib.deflate,
+    Z_BEST_COMPRESSION,
+    Z_DEFLATED,
+    -15,
+    8,
+    Z_DEFAULT_STRATEGY
+  ) != Z_OK) {
+    fprintf(stderr, "deflateInit2() failed\n");
+    return -1;
+  }
 
-    fclose(tmp);
+  if (inflateInit2(&client_ws_zlib.inflate, -15) != Z_OK) {
+    fprintf(stderr, "inflateInit2() failed\n");
+    deflateEnd(&client_ws_zlib.deflate);
+    return -1;
   }
 
-  out[1] = out_len - 2;
+  client_ws_zlib.ready = true;
+  return 0;
+}
 
-  /* reset response and copy in our new response */
-  res->buf = out;
-  res->buf_len = out_len;
+static void client_ws_zlib_free(void) {
+  if (!client_ws_zlib.ready) return;
+  deflateEnd(&client_ws_zlib.deflate);
+  inflateEnd(&client_ws_zlib.inflate);
+  client_ws_zlib.ready = false;
 }
 
-static ClientStepResult client_ws_step(Client *c) {
+static size_t client_ws_deflate(
+  const void *in,
+  size_t in_len,
+  void *out,
+  size_t out_cap
+) {
+  z_stream *zs = &client_ws_zlib.deflate;
+  deflateReset(zs);
 
-  /* ping if inactive; this gets rid of dead websockets */
-  {
-    time_t now = time(NULL);
-    long int time_since_io = now - c->last_activity;
-    long int time_since_ping = now - c->last_ping;
-    if (time_since_io > 1 && time_since_ping > 1) {
-      c->last_ping = now;
-
-      /* should probably just use an actual ping packet,
-       * but this works and it's kind of funny ... */
-      char *out;
-      size_t out_len;
-      FILE *tmp = open_memstream(&out, &out_len);
-      {
-        fprintf(tmp, "0, 0, 0, 0");
-        fclose(tmp);
-      }
-      client_ws_send_text(c, out, out_len);
+  zs->next_in = (Bytef *)in;
+  zs->avail_in = in_len;
+  zs->next_out = out;
+  zs->avail_out = out_cap;
 
-      free(out);
-    }
+  if (deflate(zs, Z_SYNC_FLUSH) != Z_OK) return 0;
+  if (zs->avail_in > 0 || zs->avail_out == 0) return 0;
+
+  /* the flush always ends in 00 00 ff ff, which
+   * the other end is supposed to put back itself */
+  return out_cap - zs->avail_out - 4;
+}
+
+/* swaps a compressed c->ws_req payload out for the inflated one */
+static int client_ws_inflate_req(Client *c) {
+  static uint8_t tail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+  z_stream *zs = &client_ws_zlib.inflate;
+  inflateReset(zs);
+  zs->next_out = (Bytef *)client_ws_zlib.out;
+  zs->avail_out = sizeof(client_ws_zlib.out);
+
+  /* the payload, then the tail the sender took off */
+  bool bad = false;
+  for (int i = 0; i < 2; i++) {
+    zs->next_in = i ? tail : (Bytef *)c->ws_req.payload;
+    zs->avail_in = i ? sizeof(tail) : c->ws_req.payload_len;
+
+    int ret = inflate(zs, Z_SYNC_FLUSH);
+    if (ret == Z_STREAM_END) break;
+    bad = (ret != Z_OK && ret != Z_BUF_ERROR) || zs->avail_in > 0;
+    if (bad) break;
   }
 
-  /* first, let's send out anything we can */
-  if (c->res.buf_len > 0) {
-    while (c->res.progress < c->res.buf_len) {
-      char byte = c->res.buf[c->res.progress];
-      ssize_t wlen = write(c->net_fd, &byte, 1);
-
-      if (wlen < 1) {
-        if (errno != EWOULDBLOCK && errno != EAGAIN) {
-          perror("client write()");
-          return ClientStepResult_Error;
-        }
-        break;
-      }
+  /* a full buffer probably means there was more where that came from */
+  if (bad || zs->avail_out == 0) {
+    fprintf(
+      stderr,
+      "WS compressed message is bad or inflates past MAX_MESSAGE_SIZE!\n"
+    );
+    return -1;
+  }
 
-      /* important to only increase this if write succeeds */
-      c->res.progress += 1;
-    }
+  c->ws_req.payload = client_ws_zlib.out;
+  c->ws_req.payload_len = sizeof(client_ws_zlib.out) - zs->avail_out;
+  return 0;
+}
 
-    c->last_activity = time(NULL);
+static ClientFrame *client_ws_frame(
+  uint8_t opcode,
+  const void *payload,
+  size_t payload_len
+) {
+  /* WS frame header, then the payload */
+  uint8_t header[CLIENT_WS_HEADER_MAX];
+  size_t header_len = client_ws_header(header, opcode, false, payload_len);
 
-    if (c->res.progress == c->res.buf_len) {
-      ClientResponse *next = c->res.next;
+  ClientFrame *f = client_frame_new(header_len + payload_len);
+  memcpy(f->data, header, header_len);
+  memcpy(f->data + header_len, payload, payload_len);
 
-      /* done writing, we can reset response */
-      free(c->res.buf);
-      memset(&c->res, 0, sizeof(c->res));
+  return f;
+}
 
-      if (next) {
-        c->res = *next;
-        free(next);
-      }
+static void client_ws_send_frame(Client *c, ClientFrame *f) {
+  ClientResponse *res = client_ws_next_res(c, f->len);
+
+  f->refs++;
+  res->frame = f;
+  res->buf = f->data;
+  res->buf_len = f->len;
+}
+
+/**
+ * Throws out every broadcast that hasn't started going out yet. The
+ * head stays, whatever it is, since part of it may be on the wire.
+ * Returns how many went.
+ **/
+static size_t client_ws_drop_broadcasts(Client *c) {
+  size_t dropped = 0;
+  ClientResponse *prev = &c->res;
+  for (ClientResponse *r = prev->next; r; r = prev->next) {
+    if (!r->broadcast) {
+      prev = r;
+      continue;
     }
+
+    prev->next = r->next;
+    c->res_bytes -= r->buf_len;
+    c->res_broadcast_bytes -= r->buf_len;
+    client_res_free_buf(r);
+    client_res_release(r);
+    dropped++;
   }
+  c->res_tail = prev;
+  return dropped;
+}
 
-  /* now let's see if there's anything to receive */
-  for (;;) {
-    char byte;
-    int read_ret = read(c->net_fd, &byte, 1);
-    if (read_ret == 0) break;
-    else if (read_ret < 0) {
-      if (errno != EWOULDBLOCK && errno != EAGAIN) {
-        return ClientStepResult_Error;
-      }
-      break;
-    }
+static bool client_ws_send_broadcast(Client *c, ClientFrame *f) {
+  if (c->ws_resync) {
+    metrics_add(&metrics_local->broadcasts_dropped, 1);
+    return false;
+  }
 
-    c->last_activity = time(NULL);
-    int progress = ++c->ws_req.progress;
+  if (c->res_broadcast_bytes + f->len > CLIENT_WS_QUEUE_HIGH) {
+    size_t dropped = client_ws_drop_broadcasts(c);
+    metrics_add(&metrics_local->broadcasts_dropped, dropped + 1);
+    metrics_add(&metrics_local->resyncs, 1);
+    c->ws_resync = true;
+    return false;
+  }
 
-    if (c->ws_req.progress > MAX_MESSAGE_SIZE)
-      return ClientStepResult_Error;
+  client_ws_send_frame(c, f);
+  c->res_tail->broadcast = true;
+  c->res_broadcast_bytes += f->len;
+  return true;
+}
 
-    if (progress == 1) {
-      c->ws_req.fin    = (byte >> 7) & 1;
-      c->ws_req.opcode = (byte >> 0) & 0b1111;
-      continue;
-    }
+/**
+ * The control frames we send that are always the same, framed once
+ * and shared; a ping costs two bytes on the wire and nothing else.
+ **/
+static char client_ws_ping_frame[] = { 0x89, 0x00 };
+static char client_ws_close_frame[] = { 0x88, 0x00 };
+
+static void client_ws_send_shared(Client *c, char *frame, size_t frame_len) {
+  ClientResponse *res = client_ws_next_res(c, frame_len);
+
+  res->buf = frame;
+  res->buf_len = frame_len;
+  res->shared = true;
+}
+
+/* the same payload back as a pong, or our half of a close */
+static void client_ws_reply(Client *c, uint8_t opcode, size_t payload_len) {
+  ClientFrame *f = client_ws_frame(opcode, c->ws_req.payload, payload_len);
+  client_ws_send_frame(c, f);
+  client_frame_unref(f);
+}
 
-    if (progress == 2) {
-      c->ws_req.has_mask    = (byte >> 7) & 1;
-      c->ws_req.payload_len = (byte >> 0) & 127;
-      if (c->ws_req.payload_len == 127 ||
-          c->ws_req.payload_len == 126) {
-        fprintf(
-          stderr,
-          "WS payloads > 126 bytes are not yet supported!\n"
+/**
+ * Pings, pongs and closes. Returns false if the client should
+ * stop being read from.
+ **/
+static bool client_ws_handle_control(Client *c) {
+  switch (c->ws_req.opcode) {
+
+    /* ping */
+    case 9: {
+      client_ws_reply(c, 10, c->ws_req.payload_len);
+    } break;
+
+    /* pong, hearing it at all was the point */
+    case 10: break;
+
+    /* close: send the status code back, then hang up once it's out */
+    case 8: {
+      if (c->ws_req.payload_len >= 2)
+        client_ws_reply(c, 8, 2);
+      else
+        client_ws_send_shared(
+          c,
+          client_ws_close_frame,
+          sizeof(client_ws_close_frame)
         );
-        return ClientStepResult_Error;
-      }
-      c->ws_req.payload = malloc(c->ws_req.payload_len);
-      continue;
+      c->ws_closing = true;
+    } break;
+
+  }
+
+  client_ws_req_done(c);
+  return !c->ws_closing;
+}
+
+/**
+ * Reads the frame header at the front of in, if there's enough of it.
+ * Returns the header length (mask included), 0 if we need more bytes
+ * first, -1 if it's one we won't take.
+ **/
+static int client_ws_parse_header(Client *c, uint8_t *in, size_t in_len) {
+  if (in_len < 2) return 0;
+
+  c->ws_req.fin      = (in[0] >> 7) & 1;
+  c->ws_req.rsv1     = (in[0] >> 6) & 1;
+  c->ws_req.opcode   = (in[0] >> 0) & 0b1111;
+  c->ws_req.has_mask = (in[1] >> 7) & 1;
+
+  uint64_t payload_len = in[1] & 127;
+  size_t header_len = 2;
+  if (payload_len == 126) {
+    if (in_len < 4) return 0;
+    payload_len = (in[2] << 8) | in[3];
+    header_len = 4;
+  } else if (payload_len == 127) {
+    if (in_len < 10) return 0;
+    payload_len = 0;
+    for (int i = 0; i < 8; i++)
+      payload_len = (payload_len << 8) | in[2 + i];
+    header_len = 10;
+  }
+
+  /* compression is only flagged on the first frame of a message */
+  if (c->ws_req.rsv1 && (!c->ws_deflate || c->ws_req.opcode == 0 ||
+                         (c->ws_req.opcode & 0b1000))) {
+    fprintf(
+      stderr,
+      "WS RSV1 set where it can't be!\n"
+    );
+    return -1;
+  }
+
+  bool control = c->ws_req.opcode & 0b1000;
+  if (control) {
+    if (!c->ws_req.fin || payload_len > 125) {
+      fprintf(
+        stderr,
+        "WS control frames can't be fragmented or > 125 bytes!\n"
+      );
+      return -1;
+    }
+  } else {
+    /* continuations only go after a first fragment, and
+     * nothing else can start until the last one is done */
+    bool continuation = c->ws_req.opcode == 0;
+    bool in_message = c->ws_msg.opcode != 0;
+    if (continuation != in_message) {
+      fprintf(
+        stderr,
+        "WS fragments out of order!\n"
+      );
+      return -1;
     }
 
-    int mask_progress = progress - 3;
-    if (c->ws_req.has_mask && mask_progress < 4) {
-      c->ws_req.mask[mask_progress] = byte;
-      continue;
+    if (payload_len > MAX_MESSAGE_SIZE - c->ws_msg.len) {
+      fprintf(
+        stderr,
+        "WS message bigger than MAX_MESSAGE_SIZE!\n"
+      );
+      return -1;
     }
+  }
+
+  if (c->ws_req.has_mask) {
+    if (in_len < header_len + 4) return 0;
+    memcpy(c->ws_req.mask, in + header_len, 4);
+    header_len += 4;
+  }
+
+  c->ws_req.payload_len = payload_len;
+  return header_len;
+}
+
+/**
+ * Tries to pull one whole message out of the front of c->recv.
+ * Returns 1 and fills out c->ws_req if there was one, 0 if we
+ * need more bytes first, -1 if the client sent us garbage.
+ *
+ * Fragments are stitched together in place as they come in, so a
+ * message that came in pieces looks the same as one that didn't.
+ * Control frames can show up in between fragments; those come
+ * back on their own, and the message carries on after them.
+ **/
+static int client_ws_parse_req(Client *c) {
+  for (;;) {
+    /* frames start after whatever we have of a fragmented message */
+    uint8_t *in = (uint8_t *)c->recv.buf + c->recv.start + c->ws_msg.len;
+    size_t in_len = c->recv.end - c->recv.start - c->ws_msg.len;
+
+    int header_len = client_ws_parse_header(c, in, in_len);
+    if (header_len <= 0) return header_len;
+
+    size_t frame_len = header_len + c->ws_req.payload_len;
+    if (in_len < frame_len) return 0;
 
     /* unmask the payload */
-    int payload_progress = mask_progress - 4;
-    uint8_t mask_byte = c->ws_req.mask[payload_progress % 4];
-    c->ws_req.payload[payload_progress] = byte ^ mask_byte;
+    c->ws_req.payload = (char *)in + header_len;
+    if (c->ws_req.has_mask)
+      for (size_t i = 0; i < c->ws_req.payload_len; i++)
+        c->ws_req.payload[i] ^= c->ws_req.mask[i % 4];
+
+    c->ws_req.frame_len = frame_len;
+
+    bool control = c->ws_req.opcode & 0b1000;
+    bool fragment = c->ws_req.opcode == 0 || !c->ws_req.fin;
+    if (control || !fragment) break;
+
+    /* squeeze the header out, so the payload lands
+     * right after the rest of the message */
+    memmove(in, in + header_len, in_len - header_len);
+    c->recv.end -= header_len;
+    c->ws_msg.len += c->ws_req.payload_len;
+    if (c->ws_req.opcode != 0) {
+      c->ws_msg.opcode = c->ws_req.opcode;
+      c->ws_msg.rsv1 = c->ws_req.rsv1;
+    }
 
-    /* handle the final payload */
-    if (payload_progress == (c->ws_req.payload_len - 1))
-      return ClientStepResult_WsMessageReady;
+    if (!c->ws_req.fin) continue;
 
+    /* that was the last piece, hand over the whole thing */
+    c->ws_req.opcode = c->ws_msg.opcode;
+    c->ws_req.rsv1 = c->ws_msg.rsv1;
+    c->ws_req.payload = c->recv.buf + c->recv.start;
+    c->ws_req.payload_len = c->ws_msg.len;
+    c->ws_req.frame_len = c->ws_msg.len;
+    memset(&c->ws_msg, 0, sizeof(c->ws_msg));
+    break;
   }
 
+  if (c->ws_req.rsv1 && client_ws_inflate_req(c) < 0)
+    return -1;
+
+  return 1;
+}
+
+static ClientStepResult client_ws_step(Client *c) {
+
+  /* ping if they've gone quiet, and give up if they stay that way */
+  long long now = event_now_ms();
+  if (!c->ws_closing && now >= client_deadline(c)) {
+    if (c->last_ping > c->last_heard)
+      return ClientStepResult_Error;
+
+    c->last_ping = now;
+    client_ws_send_shared(c, client_ws_ping_frame, sizeof(client_ws_ping_frame));
+  }
+
+  /* first, let's send out anything we can */
+  int written = client_write_res(c);
+  if (written < 0)
+    return ClientStepResult_Error;
+
+  /* our close has gone out, nothing left to do */
+  if (c->ws_closing)
+    return written ? ClientStepResult_Error : ClientStepResult_NoAction;
+
+  /* now let's see if there's anything to receive */
+  for (;;) {
+    switch (client_ws_parse_req(c)) {
+      case -1: return ClientStepResult_Error;
+      case  1: {
+        if (!(c->ws_req.opcode & 0b1000))
+          return ClientStepResult_WsMessageReady;
+
+        /* there may be something to send back now */
+        if (!client_ws_handle_control(c))
+          return ClientStepResult_Restart;
+        continue;
+      }
+    }
+
+    /* don't have a whole frame yet, go get more */
+    int filled = client_recv_fill(c);
+    if (filled < 0) return ClientStepResult_Error;
+    if (filled == 0) break;
+  }
+
+  /* pongs for any pings they sent */
+  if (client_write_res(c) < 0)
+    return ClientStepResult_Error;
+
   return ClientStepResult_NoAction;
 }
 
+static void client_ws_req_done(Client *c) {
+  if (c->ws_msg.opcode == 0) {
+    c->recv.start += c->ws_req.frame_len;
+  } else {
+    /* a control frame from the middle of a fragmented message,
+     * cut it out from behind what we have of the message */
+    char *frame = c->recv.buf + c->recv.start + c->ws_msg.len;
+    size_t after = c->recv.end - (frame - c->recv.buf) - c->ws_req.frame_len;
+    memmove(frame, frame + c->ws_req.frame_len, after);
+    c->recv.end -= c->ws_req.frame_len;
+  }
+  memset(&c->ws_req, 0, sizeof(c->ws_req));
+}
+
 static void client_ws_fwrite_sec_accept(
   FILE *out,
   const char *sec_websocket_key
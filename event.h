@@ -0,0 +1,458 @@
+// vim: sw=2 ts=2 expandtab smartindent
+
+/**
+ * A tiny readiness abstraction over poll() and epoll().
+ *
+ * Things that own an fd embed an EventSource, register it once with
+ * event_add, update it with event_mod when their interest changes, and
+ * remove it with event_del. event_wait then hands back a list of only
+ * the sources that are actually ready, so nobody has to walk every
+ * connection on every wakeup.
+ *
+ * Events are always expressed with the POLL* flags, even for epoll.
+ *
+ * The actual I/O goes through here too (event_recv, event_send,
+ * event_accept), because the io_uring backend does the reads and
+ * writes itself and only hands us the results.
+ **/
+
+#ifndef event_IMPLEMENTATION
+
+typedef enum {
+  EventBackend_Poll,
+#ifdef __linux__
+  EventBackend_Epoll,
+#endif
+#ifdef EVENT_URING
+  EventBackend_IoUring,
+#endif
+} EventBackend;
+
+#ifdef __linux__
+  #define EventBackend_Default EventBackend_Epoll
+#else
+  #define EventBackend_Default EventBackend_Poll
+#endif
+
+typedef struct EventSource {
+  int fd;
+  /* what we're currently registered for, so event_mod can be a no-op */
+  short events;
+  /* poll backend: index into EventLoop.pollfds */
+  size_t slot;
+  void *udata;
+
+  /* set by event_add */
+  struct EventLoop *loop;
+#ifdef EVENT_URING
+  struct EventUringConn *uring;
+#endif
+} EventSource;
+
+typedef struct {
+  /* NULL if the source was removed after it came back ready */
+  EventSource *src;
+  short revents;
+} EventReady;
+
+#ifdef EVENT_URING
+#include "event_uring.h"
+#endif
+
+typedef struct EventLoop {
+  EventBackend backend;
+
+  /* poll backend: one persistent pollfd per source, swap-removed */
+  struct pollfd *pollfds;
+  EventSource **pollfd_srcs;
+  size_t pollfd_count, pollfd_cap;
+
+  /* epoll backend */
+  int epoll_fd;
+
+#ifdef EVENT_URING
+  EventUring uring;
+#endif
+
+  /* filled by event_wait */
+  EventReady *ready;
+  size_t ready_count, ready_cap;
+} EventLoop;
+
+/* "poll", "epoll", "io_uring" -> EventBackend, -1 if unknown/unsupported */
+static int event_backend_parse(const char *name);
+
+static int event_init(EventLoop *ev, EventBackend backend);
+static void event_free(EventLoop *ev);
+
+static int event_add(EventLoop *ev, EventSource *src, short events);
+/* like event_add, but for a listening socket */
+static int event_add_listener(EventLoop *ev, EventSource *src);
+static int event_mod(EventLoop *ev, EventSource *src, short events);
+static void event_del(EventLoop *ev, EventSource *src);
+
+/**
+ * These behave like read(), write() and accept() on a non-blocking fd:
+ * -1 with errno set to EAGAIN when there's nothing to do right now.
+ **/
+static ssize_t event_recv(EventSource *src, void *buf, size_t len);
+static ssize_t event_send(EventSource *src, const void *buf, size_t len);
+static ssize_t event_sendv(EventSource *src, struct iovec *iov, int iov_count);
+static int event_accept(EventSource *src);
+
+/**
+ * Blocks until something is ready, or timeout_ms passes (-1 is forever).
+ * Results end up in ev->ready[0 .. ev->ready_count].
+ **/
+static int event_wait(EventLoop *ev, int timeout_ms);
+
+/**
+ * The monotonic clock in ms, as of when event_wait last came back (or
+ * event_init, before that). It's read once per wakeup, and everything
+ * that runs until the next one goes by that.
+ **/
+static long long event_now_ms(void);
+/* the same, in us, for the latency histograms */
+static long long event_now_us(void);
+/**
+ * Reads the clock again, for a loop that wants to know how long it
+ * spent since waking up. Whatever runs before the next event_wait
+ * goes by this reading instead.
+ **/
+static void event_clock_tick(void);
+
+#endif
+
+
+#ifdef event_IMPLEMENTATION
+
+static void event_ready_push(EventLoop *ev, EventSource *src, short revents);
+
+#ifdef EVENT_URING
+#include "event_uring.h"
+#endif
+
+static int event_backend_parse(const char *name) {
+  if (strcmp(name, "poll") == 0) return EventBackend_Poll;
+#ifdef __linux__
+  if (strcmp(name, "epoll") == 0) return EventBackend_Epoll;
+#endif
+#ifdef EVENT_URING
+  if (strcmp(name, "io_uring") == 0) return EventBackend_IoUring;
+#endif
+  return -1;
+}
+
+static void event_ready_push(EventLoop *ev, EventSource *src, short revents) {
+  if (ev->ready_count == ev->ready_cap) {
+    ev->ready_cap = ev->ready_cap ? ev->ready_cap * 2 : 64;
+    ev->ready = reallocarray(ev->ready, ev->ready_cap, sizeof(EventReady));
+  }
+  ev->ready[ev->ready_count++] = (EventReady) {
+    .src = src,
+    .revents = revents
+  };
+}
+
+#ifdef __linux__
+static uint32_t event_poll_to_epoll(short events) {
+  uint32_t ret = EPOLLET;
+  if (events & (POLLIN | POLLRDNORM | POLLRDBAND)) ret |= EPOLLIN;
+  if (events & POLLPRI)                            ret |= EPOLLPRI;
+  if (events & (POLLOUT | POLLWRNORM | POLLWRBAND)) ret |= EPOLLOUT;
+  return ret;
+}
+
+static short event_epoll_to_poll(uint32_t events) {
+  short ret = 0;
+  if (events & EPOLLIN ) ret |= POLLIN | POLLRDNORM;
+  if (events & EPOLLPRI) ret |= POLLPRI;
+  if (events & EPOLLOUT) ret |= POLLOUT | POLLWRNORM;
+  if (events & EPOLLHUP) ret |= POLLHUP;
+  if (events & EPOLLERR) ret |= POLLERR;
+  return ret;
+}
+#endif
+
+/* one per thread, like the loops themselves */
+static _Thread_local long long event_clock_us;
+
+static void event_clock_tick(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  event_clock_us = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long event_now_ms(void) {
+  return event_clock_us / 1000;
+}
+
+static long long event_now_us(void) {
+  return event_clock_us;
+}
+
+static int event_init(EventLoop *ev, EventBackend backend) {
+  *ev = (EventLoop) { .backend = backend, .epoll_fd = -1 };
+  event_clock_tick();
+
+#ifdef __linux__
+  if (backend == EventBackend_Epoll) {
+    ev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev->epoll_fd < 0) {
+      perror("epoll_create1()");
+      return -1;
+    }
+  }
+#endif
+
+#ifdef EVENT_URING
+  ev->uring.fd = -1;
+  if (backend == EventBackend_IoUring && event_uring_init(&ev->uring) < 0)
+    return -1;
+#endif
+
+  return 0;
+}
+
+static void event_free(EventLoop *ev) {
+  if (ev->epoll_fd >= 0) close(ev->epoll_fd);
+#ifdef EVENT_URING
+  event_uring_free(&ev->uring);
+#endif
+  free(ev->pollfds);
+  free(ev->pollfd_srcs);
+  free(ev->ready);
+  *ev = (EventLoop) { .epoll_fd = -1 };
+}
+
+static int event_add(EventLoop *ev, EventSource *src, short events) {
+  src->events = events;
+  src->loop = ev;
+
+  switch (ev->backend) {
+
+    case EventBackend_Poll: {
+      if (ev->pollfd_count == ev->pollfd_cap) {
+        ev->pollfd_cap = ev->pollfd_cap ? ev->pollfd_cap * 2 : 64;
+        ev->pollfds = reallocarray(
+          ev->pollfds,
+          ev->pollfd_cap,
+          sizeof(struct pollfd)
+        );
+        ev->pollfd_srcs = reallocarray(
+          ev->pollfd_srcs,
+          ev->pollfd_cap,
+          sizeof(EventSource *)
+        );
+      }
+
+      src->slot = ev->pollfd_count++;
+      ev->pollfds[src->slot] = (struct pollfd) {
+        .fd = src->fd,
+        .events = events
+      };
+      ev->pollfd_srcs[src->slot] = src;
+    } break;
+
+#ifdef __linux__
+    case EventBackend_Epoll: {
+      struct epoll_event ee = {
+        .events = event_poll_to_epoll(events),
+        .data.ptr = src
+      };
+      if (epoll_ctl(ev->epoll_fd, EPOLL_CTL_ADD, src->fd, &ee) < 0) {
+        perror("epoll_ctl(ADD)");
+        return -1;
+      }
+    } break;
+#endif
+
+#ifdef EVENT_URING
+    case EventBackend_IoUring: {
+      return event_uring_add(ev, src, false);
+    } break;
+#endif
+
+  }
+
+  return 0;
+}
+
+static int event_add_listener(EventLoop *ev, EventSource *src) {
+#ifdef EVENT_URING
+  if (ev->backend == EventBackend_IoUring) {
+    src->events = POLLIN;
+    src->loop = ev;
+    return event_uring_add(ev, src, true);
+  }
+#endif
+
+  return event_add(ev, src, POLLIN);
+}
+
+static int event_mod(EventLoop *ev, EventSource *src, short events) {
+  if (src->events == events) return 0;
+  src->events = events;
+
+  switch (ev->backend) {
+
+    case EventBackend_Poll: {
+      ev->pollfds[src->slot].events = events;
+    } break;
+
+#ifdef __linux__
+    case EventBackend_Epoll: {
+      /* re-arming also reports the fd again if it's already ready,
+       * so we don't miss an edge that happened before we cared */
+      struct epoll_event ee = {
+        .events = event_poll_to_epoll(events),
+        .data.ptr = src
+      };
+      if (epoll_ctl(ev->epoll_fd, EPOLL_CTL_MOD, src->fd, &ee) < 0) {
+        perror("epoll_ctl(MOD)");
+        return -1;
+      }
+    } break;
+#endif
+
+#ifdef EVENT_URING
+    case EventBackend_IoUring: {
+      event_uring_mod(ev, src);
+    } break;
+#endif
+
+  }
+
+  return 0;
+}
+
+static void event_del(EventLoop *ev, EventSource *src) {
+  switch (ev->backend) {
+
+    case EventBackend_Poll: {
+      /* swap the last slot into the hole */
+      size_t last = --ev->pollfd_count;
+      if (src->slot != last) {
+        ev->pollfds[src->slot] = ev->pollfds[last];
+        ev->pollfd_srcs[src->slot] = ev->pollfd_srcs[last];
+        ev->pollfd_srcs[src->slot]->slot = src->slot;
+      }
+    } break;
+
+#ifdef __linux__
+    case EventBackend_Epoll: {
+      epoll_ctl(ev->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+    } break;
+#endif
+
+#ifdef EVENT_URING
+    case EventBackend_IoUring: {
+      event_uring_del(ev, src);
+    } break;
+#endif
+
+  }
+
+  /* it may still be sitting in the ready list we're iterating over */
+  for (size_t i = 0; i < ev->ready_count; i++)
+    if (ev->ready[i].src == src)
+      ev->ready[i].src = NULL;
+}
+
+static int event_wait_ready(EventLoop *ev, int timeout_ms) {
+  ev->ready_count = 0;
+
+  switch (ev->backend) {
+
+    case EventBackend_Poll: {
+      int updated = poll(ev->pollfds, ev->pollfd_count, timeout_ms);
+      if (updated < 0) {
+        if (errno != EINTR) perror("poll()");
+        return -1;
+      }
+
+      for (size_t i = 0; updated > 0 && i < ev->pollfd_count; i++)
+        if (ev->pollfds[i].revents) {
+          event_ready_push(ev, ev->pollfd_srcs[i], ev->pollfds[i].revents);
+          updated--;
+        }
+    } break;
+
+#ifdef __linux__
+    case EventBackend_Epoll: {
+      struct epoll_event ees[256];
+      int updated = epoll_wait(
+        ev->epoll_fd,
+        ees,
+        sizeof(ees) / sizeof(ees[0]),
+        timeout_ms
+      );
+      if (updated < 0) {
+        if (errno != EINTR) perror("epoll_wait()");
+        return -1;
+      }
+
+      for (int i = 0; i < updated; i++)
+        event_ready_push(
+          ev,
+          ees[i].data.ptr,
+          event_epoll_to_poll(ees[i].events)
+        );
+    } break;
+#endif
+
+#ifdef EVENT_URING
+    case EventBackend_IoUring: {
+      return event_uring_wait(ev, timeout_ms);
+    } break;
+#endif
+
+  }
+
+  return 0;
+}
+
+static ssize_t event_recv(EventSource *src, void *buf, size_t len) {
+#ifdef EVENT_URING
+  if (src->uring) return event_uring_recv(src->loop, src->uring, buf, len);
+#endif
+  return read(src->fd, buf, len);
+}
+
+static ssize_t event_send(EventSource *src, const void *buf, size_t len) {
+#ifdef EVENT_URING
+  if (src->uring) return event_uring_send(src->loop, src->uring, buf, len);
+#endif
+  return write(src->fd, buf, len);
+}
+
+static ssize_t event_sendv(EventSource *src, struct iovec *iov, int iov_count) {
+#ifdef EVENT_URING
+  if (src->uring) {
+    /* it all just gets copied into the same tx buffer anyways */
+    ssize_t total = 0;
+    for (int i = 0; i < iov_count; i++) {
+      ssize_t sent = event_send(src, iov[i].iov_base, iov[i].iov_len);
+      if (sent < 0) return total ? total : -1;
+      total += sent;
+    }
+    return total;
+  }
+#endif
+  return writev(src->fd, iov, iov_count);
+}
+
+static int event_accept(EventSource *src) {
+#ifdef EVENT_URING
+  if (src->uring) return event_uring_accept(src->uring);
+#endif
+  return socket_accept_client(src->fd);
+}
+
+static int event_wait(EventLoop *ev, int timeout_ms) {
+  int ret = event_wait_ready(ev, timeout_ms);
+  event_clock_tick();
+  return ret;
+}
+
+#endif
@@ -0,0 +1,783 @@
+// vim: sw=2 ts=2 expandtab smartindent
+
+/**
+ * The io_uring backend for event.h, talking to the kernel directly
+ * through the raw syscalls and mmap'd rings (no liburing).
+ *
+ *  - the listener gets one multishot accept, so new connections show up
+ *    as completions instead of a wakeup followed by an accept() loop.
+ *
+ *  - every connection gets one multishot recv that picks its buffers out
+ *    of a ring of provided buffers; we copy what arrives into a per-
+ *    connection rx buffer which event_recv drains. If that isn't being
+ *    drained (EVENT_URING_RX_MAX), the recv is cancelled until it is,
+ *    the same as poll and epoll leaving bytes in the socket.
+ *
+ *  - event_send only appends to a per-connection tx buffer. Right before
+ *    we wait, every connection with pending bytes gets a single send, and
+ *    they all go to the kernel in the same io_uring_enter. A broadcast to
+ *    N peers is one syscall, not N (or N*bytes).
+ *
+ * Each connection has at most one send in flight, so bytes can't get
+ * reordered by a short write; whatever piles up in the meantime goes out
+ * with the next one.
+ **/
+
+#ifndef event_IMPLEMENTATION
+
+typedef struct {
+  char *buf;
+  size_t len, cap, off;
+} EventUringBuf;
+
+/**
+ * Per-fd state. This has to be able to outlive its EventSource,
+ * because the kernel can still owe us completions after event_del,
+ * and an HTTP response may still be on its way out.
+ **/
+typedef struct EventUringConn {
+  /* every conn, so event_free can clean up the orphans */
+  struct EventUringConn *prev, *next;
+  /* conns with bytes in tx that still need a send */
+  struct EventUringConn *next_dirty;
+  /* conns with something to report from this event_wait */
+  struct EventUringConn *next_woken;
+
+  /* NULL once event_del'd */
+  EventSource *src;
+  /* the src's fd, or our own dup of it once the src is gone */
+  int fd;
+
+  /* ops the kernel still owes us a final completion for */
+  int inflight;
+  bool listener, recv_armed, send_armed, dirty, tx_full, eof;
+  /* rx is full, the recv stays cancelled until it's drained */
+  bool rx_full;
+  int err;
+  short revents;
+
+  EventUringBuf rx, tx, tx_kernel;
+
+  /* listener only: accepted fds waiting for event_accept */
+  int *accepted;
+  size_t accepted_len, accepted_cap;
+} EventUringConn;
+
+typedef struct {
+  int fd;
+
+  /* submission ring */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries, sq_local_tail, to_submit;
+  struct io_uring_sqe *sqes;
+
+  /* completion ring */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *ring_ptr;
+  size_t ring_size, sqes_size;
+
+  /* provided buffers for the multishot receives */
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *bufs;
+  unsigned short buf_tail;
+
+  EventUringConn *conns, *dirty, *woken;
+} EventUring;
+
+#endif
+
+
+#ifdef event_IMPLEMENTATION
+
+#define EVENT_URING_ENTRIES   4096
+#define EVENT_URING_BUF_COUNT 512 /* power of two */
+#define EVENT_URING_BUF_SIZE  4096
+#define EVENT_URING_BUF_GROUP 0
+/* past this, event_send starts saying EAGAIN */
+#define EVENT_URING_TX_MAX    (1 << 16)
+/* past this, we stop receiving until event_recv gets it under half */
+#define EVENT_URING_RX_MAX    (1 << 16)
+
+/* what an op was, packed into the low bits of user_data */
+#define EVENT_URING_TAG_ACCEPT 1
+#define EVENT_URING_TAG_RECV   2
+#define EVENT_URING_TAG_SEND   3
+#define EVENT_URING_TAG_CANCEL 4
+#define EVENT_URING_TAG_MASK   7
+
+static int event_uring_enter(
+  EventUring *u,
+  unsigned to_submit,
+  unsigned min_complete,
+  unsigned flags,
+  void *arg,
+  size_t arg_size
+) {
+  return syscall(
+    __NR_io_uring_enter,
+    u->fd,
+    to_submit,
+    min_complete,
+    flags,
+    arg,
+    arg_size
+  );
+}
+
+static void event_uring_buf_push(EventUringBuf *b, const void *data, size_t len) {
+  /* what's been read off the front makes room before growing does */
+  if (b->len + len > b->cap && b->off > 0) {
+    memmove(b->buf, b->buf + b->off, b->len - b->off);
+    b->len -= b->off;
+    b->off = 0;
+  }
+  if (b->len + len > b->cap) {
+    b->cap = b->cap ? b->cap : 256;
+    while (b->cap < b->len + len) b->cap *= 2;
+    b->buf = realloc(b->buf, b->cap);
+  }
+  memcpy(b->buf + b->len, data, len);
+  b->len += len;
+}
+
+static void event_uring_provide_buf(EventUring *u, unsigned short bid) {
+  struct io_uring_buf *b =
+    &u->buf_ring->bufs[u->buf_tail & (EVENT_URING_BUF_COUNT - 1)];
+  b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * EVENT_URING_BUF_SIZE);
+  b->len = EVENT_URING_BUF_SIZE;
+  b->bid = bid;
+  u->buf_tail++;
+  __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int event_uring_submit(EventUring *u);
+static struct io_uring_sqe *event_uring_sqe(EventUring *u, uint64_t user_data);
+
+/* whether the kernel knows every op we use */
+static bool event_uring_has_ops(EventUring *u) {
+  static const int ops[] = {
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ASYNC_CANCEL
+  };
+
+  size_t ops_len = 256;
+  struct io_uring_probe *probe = calloc(
+    1,
+    sizeof(*probe) + ops_len * sizeof(struct io_uring_probe_op)
+  );
+  if (probe == NULL) return false;
+
+  bool ok = syscall(
+    __NR_io_uring_register,
+    u->fd,
+    IORING_REGISTER_PROBE,
+    probe,
+    ops_len
+  ) >= 0;
+  for (size_t i = 0; ok && i < sizeof(ops) / sizeof(*ops); i++)
+    ok = ops[i] < probe->ops_len &&
+         (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+
+  free(probe);
+  return ok;
+}
+
+/**
+ * Multishot recv (6.0) doesn't show up in the probe, so we try one on
+ * a socketpair: a kernel without it turns it down, or finishes it after
+ * a single completion.
+ **/
+static bool event_uring_has_multishot_recv(EventUring *u) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+    perror("socketpair()");
+    return false;
+  }
+
+  struct io_uring_sqe *sqe = event_uring_sqe(u, 0);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sv[0];
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = EVENT_URING_BUF_GROUP;
+
+  /* a byte for it to take, then the end of the stream so it stops */
+  send(sv[1], "", 1, MSG_NOSIGNAL);
+  close(sv[1]);
+
+  bool multishot = false, done = event_uring_submit(u) < 0;
+  while (!done) {
+    if (event_uring_enter(u, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      if (errno == EINTR) continue;
+      perror("io_uring_enter()");
+      break;
+    }
+
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+        event_uring_provide_buf(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      if (cqe->flags & IORING_CQE_F_MORE) multishot = true;
+      else done = true;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  close(sv[0]);
+  return multishot;
+}
+
+static int event_uring_init(EventUring *u) {
+  *u = (EventUring) { .fd = -1 };
+
+  struct io_uring_params p = {0};
+  u->fd = syscall(__NR_io_uring_setup, EVENT_URING_ENTRIES, &p);
+  if (u->fd < 0) {
+    perror("io_uring_setup()");
+    return -1;
+  }
+
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_EXT_ARG)) {
+    fprintf(stderr, "io_uring: kernel too old\n");
+    close(u->fd);
+    return -1;
+  }
+
+  /* with SINGLE_MMAP, both rings live in the same mapping */
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  u->ring_ptr = mmap(
+    NULL, u->ring_size,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    u->fd, IORING_OFF_SQ_RING
+  );
+  if (u->ring_ptr == MAP_FAILED) {
+    perror("mmap(io_uring rings)");
+    close(u->fd);
+    return -1;
+  }
+
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(
+    NULL, u->sqes_size,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    u->fd, IORING_OFF_SQES
+  );
+  if (u->sqes == MAP_FAILED) {
+    perror("mmap(io_uring sqes)");
+    munmap(u->ring_ptr, u->ring_size);
+    close(u->fd);
+    return -1;
+  }
+
+  char *ring = u->ring_ptr;
+  u->sq_head    = (unsigned *)(ring + p.sq_off.head);
+  u->sq_tail    = (unsigned *)(ring + p.sq_off.tail);
+  u->sq_mask    = (unsigned *)(ring + p.sq_off.ring_mask);
+  u->sq_array   = (unsigned *)(ring + p.sq_off.array);
+  u->sq_entries = p.sq_entries;
+  u->sq_local_tail = *u->sq_tail;
+
+  u->cq_head = (unsigned *)(ring + p.cq_off.head);
+  u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+  /* the provided buffer ring has to be page aligned, so mmap it */
+  u->buf_ring_size = EVENT_URING_BUF_COUNT * sizeof(struct io_uring_buf);
+  u->buf_ring = mmap(
+    NULL, u->buf_ring_size,
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+    -1, 0
+  );
+  u->bufs = malloc((size_t)EVENT_URING_BUF_COUNT * EVENT_URING_BUF_SIZE);
+  if (u->buf_ring == MAP_FAILED || u->bufs == NULL) {
+    perror("io_uring buffers");
+    goto fail;
+  }
+
+  struct io_uring_buf_reg reg = {
+    .ring_addr = (uint64_t)(uintptr_t)u->buf_ring,
+    .ring_entries = EVENT_URING_BUF_COUNT,
+    .bgid = EVENT_URING_BUF_GROUP,
+  };
+  if (syscall(
+    __NR_io_uring_register,
+    u->fd,
+    IORING_REGISTER_PBUF_RING,
+    &reg,
+    1
+  ) < 0) {
+    perror("io_uring_register(PBUF_RING)");
+    goto fail;
+  }
+
+  for (unsigned short i = 0; i < EVENT_URING_BUF_COUNT; i++)
+    event_uring_provide_buf(u, i);
+
+  /* without these every client would fail later on, with nothing said */
+  if (!event_uring_has_ops(u) || !event_uring_has_multishot_recv(u)) {
+    fprintf(stderr, "io_uring: kernel too old\n");
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  if (u->buf_ring != MAP_FAILED) munmap(u->buf_ring, u->buf_ring_size);
+  free(u->bufs);
+  munmap(u->sqes, u->sqes_size);
+  munmap(u->ring_ptr, u->ring_size);
+  close(u->fd);
+  *u = (EventUring) { .fd = -1 };
+  return -1;
+}
+
+static void event_uring_conn_free(EventUring *u, EventUringConn *conn) {
+  if (conn->prev) conn->prev->next = conn->next;
+  else            u->conns = conn->next;
+  if (conn->next) conn->next->prev = conn->prev;
+
+  /* a dup we made to finish sending after event_del */
+  if (conn->src == NULL && conn->fd >= 0) close(conn->fd);
+
+  if (conn->listener)
+    for (size_t i = 0; i < conn->accepted_len; i++)
+      close(conn->accepted[i]);
+
+  free(conn->accepted);
+  free(conn->rx.buf);
+  free(conn->tx.buf);
+  free(conn->tx_kernel.buf);
+  free(conn);
+}
+
+static void event_uring_free(EventUring *u) {
+  if (u->fd < 0) return;
+
+  while (u->conns) event_uring_conn_free(u, u->conns);
+
+  munmap(u->buf_ring, u->buf_ring_size);
+  free(u->bufs);
+  munmap(u->sqes, u->sqes_size);
+  munmap(u->ring_ptr, u->ring_size);
+  close(u->fd);
+  *u = (EventUring) { .fd = -1 };
+}
+
+static int event_uring_submit(EventUring *u) {
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+  while (u->to_submit) {
+    int ret = event_uring_enter(u, u->to_submit, 0, 0, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      perror("io_uring_enter()");
+      return -1;
+    }
+    u->to_submit -= ret;
+  }
+  return 0;
+}
+
+static struct io_uring_sqe *event_uring_sqe(EventUring *u, uint64_t user_data) {
+  unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  if (u->sq_local_tail - head >= u->sq_entries)
+    event_uring_submit(u);
+
+  unsigned idx = u->sq_local_tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->user_data = user_data;
+  u->sq_array[idx] = idx;
+  u->sq_local_tail++;
+  u->to_submit++;
+  return sqe;
+}
+
+static uint64_t event_uring_tag(EventUringConn *conn, int tag) {
+  return (uint64_t)(uintptr_t)conn | tag;
+}
+
+static void event_uring_arm_accept(EventUring *u, EventUringConn *conn) {
+  struct io_uring_sqe *sqe = event_uring_sqe(
+    u,
+    event_uring_tag(conn, EVENT_URING_TAG_ACCEPT)
+  );
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  conn->recv_armed = true;
+  conn->inflight++;
+}
+
+static void event_uring_arm_recv(EventUring *u, EventUringConn *conn) {
+  struct io_uring_sqe *sqe = event_uring_sqe(
+    u,
+    event_uring_tag(conn, EVENT_URING_TAG_RECV)
+  );
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = EVENT_URING_BUF_GROUP;
+  conn->recv_armed = true;
+  conn->inflight++;
+}
+
+/* cancels the recv or accept on conn; the op still gets a last completion */
+static void event_uring_cancel(EventUring *u, EventUringConn *conn) {
+  struct io_uring_sqe *sqe = event_uring_sqe(
+    u,
+    event_uring_tag(conn, EVENT_URING_TAG_CANCEL)
+  );
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = event_uring_tag(
+    conn,
+    conn->listener ? EVENT_URING_TAG_ACCEPT : EVENT_URING_TAG_RECV
+  );
+  conn->inflight++;
+}
+
+/* hands whatever is in tx to the kernel, if nothing else is in flight */
+static void event_uring_arm_send(EventUring *u, EventUringConn *conn) {
+  if (conn->send_armed) return;
+
+  if (conn->tx_kernel.off == conn->tx_kernel.len) {
+    if (conn->tx.len == 0) return;
+
+    /* swap so we keep both allocations around */
+    EventUringBuf tmp = conn->tx_kernel;
+    conn->tx_kernel = conn->tx;
+    conn->tx = tmp;
+    conn->tx.len = conn->tx.off = 0;
+  }
+
+  struct io_uring_sqe *sqe = event_uring_sqe(
+    u,
+    event_uring_tag(conn, EVENT_URING_TAG_SEND)
+  );
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(conn->tx_kernel.buf + conn->tx_kernel.off);
+  sqe->len = conn->tx_kernel.len - conn->tx_kernel.off;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  conn->send_armed = true;
+  conn->inflight++;
+}
+
+static void event_uring_wake(EventUring *u, EventUringConn *conn, short revents) {
+  if (conn->src == NULL) return;
+  if (conn->revents == 0) {
+    conn->next_woken = u->woken;
+    u->woken = conn;
+  }
+  conn->revents |= revents;
+}
+
+static void event_uring_mark_dirty(EventUring *u, EventUringConn *conn) {
+  if (conn->dirty) return;
+  conn->dirty = true;
+  conn->next_dirty = u->dirty;
+  u->dirty = conn;
+}
+
+/* orphans are freed once the kernel is done with them */
+static void event_uring_maybe_free(EventUring *u, EventUringConn *conn) {
+  if (conn->src || conn->dirty || conn->inflight > 0) return;
+  event_uring_conn_free(u, conn);
+}
+
+static int event_uring_add(EventLoop *ev, EventSource *src, bool listener) {
+  EventUring *u = &ev->uring;
+
+  EventUringConn *conn = calloc(sizeof(EventUringConn), 1);
+  conn->src = src;
+  conn->fd = src->fd;
+  conn->listener = listener;
+
+  conn->next = u->conns;
+  if (u->conns) u->conns->prev = conn;
+  u->conns = conn;
+
+  src->uring = conn;
+
+  if (listener) event_uring_arm_accept(u, conn);
+  else          event_uring_arm_recv(u, conn);
+
+  return 0;
+}
+
+static void event_uring_mod(EventLoop *ev, EventSource *src) {
+  /* there's no readiness to re-arm, just make sure someone that
+   * now wants to write gets a chance to, if there's room for it */
+  EventUringConn *conn = src->uring;
+  if ((src->events & (POLLOUT | POLLWRNORM | POLLWRBAND)) && !conn->tx_full)
+    event_uring_wake(&ev->uring, conn, POLLOUT | POLLWRNORM);
+}
+
+static void event_uring_del(EventLoop *ev, EventSource *src) {
+  EventUring *u = &ev->uring;
+  EventUringConn *conn = src->uring;
+  src->uring = NULL;
+
+  /* take it out of the woken list so we don't report a dead source */
+  if (conn->revents) {
+    for (EventUringConn **w = &u->woken; *w; w = &(*w)->next_woken)
+      if (*w == conn) {
+        *w = conn->next_woken;
+        break;
+      }
+    conn->revents = 0;
+  }
+
+  conn->src = NULL;
+
+  if (conn->recv_armed) event_uring_cancel(u, conn);
+
+  /* whoever owns src is about to close the fd, but there may still be
+   * a response on its way out. hang on to our own copy of the fd until
+   * it's gone, and make sure it actually gets sent. */
+  bool unsent = conn->send_armed || conn->tx.len > 0;
+  if (unsent && !conn->err) {
+    conn->fd = dup(conn->fd);
+    event_uring_arm_send(u, conn);
+    event_uring_submit(u);
+  } else {
+    conn->fd = -1;
+    event_uring_submit(u);
+    event_uring_maybe_free(u, conn);
+  }
+}
+
+static void event_uring_complete(EventUring *u, struct io_uring_cqe *cqe) {
+  if (cqe->user_data == 0) return;
+
+  EventUringConn *conn = (EventUringConn *)(uintptr_t)
+    (cqe->user_data & ~(uint64_t)EVENT_URING_TAG_MASK);
+  int tag = cqe->user_data & EVENT_URING_TAG_MASK;
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+
+  switch (tag) {
+
+    case EVENT_URING_TAG_ACCEPT: {
+      if (cqe->res >= 0) {
+        if (conn->src == NULL) {
+          close(cqe->res);
+        } else {
+          if (conn->accepted_len == conn->accepted_cap) {
+            conn->accepted_cap = conn->accepted_cap ? conn->accepted_cap*2 : 16;
+            conn->accepted = reallocarray(
+              conn->accepted,
+              conn->accepted_cap,
+              sizeof(int)
+            );
+          }
+          conn->accepted[conn->accepted_len++] = cqe->res;
+          event_uring_wake(u, conn, POLLIN | POLLRDNORM);
+        }
+      }
+
+      if (!more) {
+        conn->recv_armed = false;
+        conn->inflight--;
+        if (conn->src) event_uring_arm_accept(u, conn);
+      }
+    } break;
+
+    case EVENT_URING_TAG_RECV: {
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && conn->src) {
+          event_uring_buf_push(
+            &conn->rx,
+            u->bufs + (size_t)bid * EVENT_URING_BUF_SIZE,
+            cqe->res
+          );
+          event_uring_wake(u, conn, POLLIN | POLLRDNORM);
+        }
+        event_uring_provide_buf(u, bid);
+
+        /* nobody's reading, so the kernel can hang on to the rest */
+        if (!conn->rx_full && more &&
+            conn->rx.len - conn->rx.off >= EVENT_URING_RX_MAX) {
+          conn->rx_full = true;
+          event_uring_cancel(u, conn);
+        }
+      }
+
+      if (cqe->res == 0) {
+        conn->eof = true;
+        event_uring_wake(u, conn, POLLIN | POLLRDNORM);
+      } else if (cqe->res < 0 &&
+                 cqe->res != -ENOBUFS &&
+                 cqe->res != -ECANCELED) {
+        conn->err = -cqe->res;
+        event_uring_wake(u, conn, POLLERR);
+      }
+
+      if (!more) {
+        conn->recv_armed = false;
+        conn->inflight--;
+        /* ran out of provided buffers, we've just given some back
+         * (or we cancelled it, and event_recv re-arms it) */
+        if (conn->src && !conn->eof && !conn->err && !conn->rx_full)
+          event_uring_arm_recv(u, conn);
+      }
+    } break;
+
+    case EVENT_URING_TAG_SEND: {
+      conn->send_armed = false;
+      conn->inflight--;
+
+      if (cqe->res < 0) {
+        conn->err = -cqe->res;
+        conn->tx.len = conn->tx.off = 0;
+        conn->tx_kernel.len = conn->tx_kernel.off = 0;
+        event_uring_wake(u, conn, POLLERR);
+        break;
+      }
+
+      conn->tx_kernel.off += cqe->res;
+      if (conn->tx_kernel.off == conn->tx_kernel.len)
+        conn->tx_kernel.len = conn->tx_kernel.off = 0;
+
+      /* a short send goes right back out, the rest waits for a flush */
+      event_uring_arm_send(u, conn);
+
+      if (conn->tx_full && conn->tx.len < EVENT_URING_TX_MAX) {
+        conn->tx_full = false;
+        event_uring_wake(u, conn, POLLOUT | POLLWRNORM);
+      }
+    } break;
+
+    case EVENT_URING_TAG_CANCEL: {
+      conn->inflight--;
+    } break;
+
+  }
+
+  event_uring_maybe_free(u, conn);
+}
+
+static int event_uring_wait(EventLoop *ev, int timeout_ms) {
+  EventUring *u = &ev->uring;
+
+  /* everyone who got written to since last time gets one send */
+  while (u->dirty) {
+    EventUringConn *conn = u->dirty;
+    u->dirty = conn->next_dirty;
+    conn->dirty = false;
+    event_uring_arm_send(u, conn);
+    event_uring_maybe_free(u, conn);
+  }
+
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+  /* don't block if we've already got something to report */
+  struct __kernel_timespec ts = {
+    .tv_sec = timeout_ms / 1000,
+    .tv_nsec = (timeout_ms % 1000) * 1000000L
+  };
+  struct io_uring_getevents_arg arg = {
+    .ts = timeout_ms < 0 ? 0 : (uint64_t)(uintptr_t)&ts
+  };
+  unsigned min_complete = u->woken ? 0 : 1;
+
+  int ret = event_uring_enter(
+    u,
+    u->to_submit,
+    min_complete,
+    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+    &arg,
+    sizeof arg
+  );
+  if (ret >= 0) {
+    u->to_submit -= ret;
+  } else if (errno != EINTR && errno != ETIME) {
+    perror("io_uring_enter()");
+    return -1;
+  }
+
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+    event_uring_complete(u, &u->cqes[head & *u->cq_mask]);
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+  /* re-arms from the completions above go out with the next wait */
+  for (EventUringConn *conn = u->woken; conn; conn = conn->next_woken) {
+    event_ready_push(ev, conn->src, conn->revents);
+    conn->revents = 0;
+  }
+  u->woken = NULL;
+
+  return 0;
+}
+
+static ssize_t event_uring_recv(
+  EventLoop *ev,
+  EventUringConn *conn,
+  void *buf,
+  size_t len
+) {
+  size_t avail = conn->rx.len - conn->rx.off;
+  if (avail == 0) {
+    if (conn->err) { errno = conn->err; return -1; }
+    if (conn->eof) return 0;
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (len > avail) len = avail;
+  memcpy(buf, conn->rx.buf + conn->rx.off, len);
+  conn->rx.off += len;
+  if (conn->rx.off == conn->rx.len) conn->rx.off = conn->rx.len = 0;
+
+  /* if the cancel hasn't come back yet, its completion re-arms it */
+  if (conn->rx_full && conn->rx.len - conn->rx.off < EVENT_URING_RX_MAX / 2) {
+    conn->rx_full = false;
+    if (!conn->recv_armed && !conn->eof && !conn->err)
+      event_uring_arm_recv(&ev->uring, conn);
+  }
+  return len;
+}
+
+static ssize_t event_uring_send(
+  EventLoop *ev,
+  EventUringConn *conn,
+  const void *buf,
+  size_t len
+) {
+  if (conn->err) { errno = conn->err; return -1; }
+
+  if (conn->tx.len >= EVENT_URING_TX_MAX) {
+    conn->tx_full = true;
+    errno = EAGAIN;
+    return -1;
+  }
+
+  event_uring_buf_push(&conn->tx, buf, len);
+  event_uring_mark_dirty(&ev->uring, conn);
+  return len;
+}
+
+static int event_uring_accept(EventUringConn *conn) {
+  if (conn->accepted_len == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  int fd = conn->accepted[--conn->accepted_len];
+  socket_log_accepted(fd);
+  return fd;
+}
+
+#endif
@@ -0,0 +1,346 @@
+// vim: sw=2 ts=2 expandtab smartindent
+
+/**
+ * Counters, gauges and histograms for /metrics, in the Prometheus
+ * text format.
+ *
+ * Every thread that runs a Server gets a Metrics block of its own, and
+ * it's the only one that ever writes to it, so recording something is
+ * a load and a store; they're relaxed atomics only so that whichever
+ * thread answers /metrics can read them without tearing. The blocks are
+ * strung on a list that only ever gets pushed onto and are never freed
+ * until the process is done, so reading them takes no locks either.
+ *
+ * Counters and gauges go out per shard (a shard="n" label), since each
+ * shard keeps its own copy of every room. The histograms are added up
+ * across all of them.
+ **/
+
+#ifndef metrics_IMPLEMENTATION
+
+/**
+ * HDR-style histograms of microseconds: every power of two is split
+ * into METRICS_HIST_SUB evenly spaced buckets, so each bucket is within
+ * 25% of its neighbors whether it's 10us or 10s. Anything past the last
+ * one (about 33s) only shows up in +Inf.
+ **/
+#define METRICS_HIST_SUB_BITS 2
+#define METRICS_HIST_SUB (1 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_BUCKETS (24 * METRICS_HIST_SUB)
+typedef struct {
+  _Atomic uint64_t buckets[METRICS_HIST_BUCKETS];
+  _Atomic uint64_t count, sum_us;
+} MetricsHist;
+
+/* indexed by ClientPhase */
+#define METRICS_PHASE_COUNT (ClientPhase_Websocket + 1)
+
+typedef struct Metrics {
+  /* the next on metrics_all's list */
+  struct Metrics *all_next;
+  size_t shard;
+
+  /* counters */
+  _Atomic uint64_t accepted;
+  /* points our own clients sent in */
+  _Atomic uint64_t points_ingested;
+  /* records sent out to a room (adds, removes and evicts), once each
+   * no matter how many members there are */
+  _Atomic uint64_t points_broadcast;
+  /* points pushed out of a room's ring by newer ones */
+  _Atomic uint64_t points_evicted;
+  _Atomic uint64_t bytes_received, bytes_sent;
+  _Atomic uint64_t poll_wakeups;
+  /* broadcast frames thrown out for slow clients, and how many times
+   * one of them had to start over (see CLIENT_WS_QUEUE_HIGH) */
+  _Atomic uint64_t broadcasts_dropped, resyncs;
+
+  /* gauges, as of the last sweep */
+  _Atomic uint64_t clients[METRICS_PHASE_COUNT];
+  /* bytes waiting in clients' response queues, in all and the longest */
+  _Atomic uint64_t queued_bytes, queued_bytes_max;
+  _Atomic uint64_t rooms;
+
+  /* how long one time around the event loop took, minus the waiting */
+  MetricsHist loop;
+  /**
+   * From a point being read off a client's socket (on whichever shard
+   * that was) to it being queued up for this shard's clients, which
+   * is mostly however long --coalesce kept it waiting. It comes in at
+   * the wakeup it was read on (event_now_us), and it's queued once the
+   * clock has been read after its batch went out, which is once per
+   * batch; without --coalesce, once per wakeup for all of that
+   * wakeup's points, after they've been handled.
+   **/
+  MetricsHist fanout;
+} Metrics;
+
+/**
+ * This thread's block. Until metrics_thread_init is called it's one
+ * nobody reports on, so there's always somewhere to count things.
+ **/
+static _Thread_local Metrics *metrics_local;
+
+/* gives this thread a block of its own, reported under `shard` */
+static void metrics_thread_init(size_t shard);
+/* for once every thread that was recording is gone */
+static void metrics_free(void);
+
+static void metrics_add(_Atomic uint64_t *counter, uint64_t n);
+static void metrics_set(_Atomic uint64_t *gauge, uint64_t v);
+static void metrics_observe(MetricsHist *h, long long us);
+
+/* reads the monotonic clock, in us; event_now_us() is free, this isn't */
+static long long metrics_now_us(void);
+
+/* everything there is, from every thread, as a /metrics body */
+static void metrics_render(FILE *out);
+
+#endif
+
+
+#ifdef metrics_IMPLEMENTATION
+
+static Metrics metrics_nobody;
+static _Thread_local Metrics *metrics_local = &metrics_nobody;
+static _Atomic(Metrics *) metrics_all;
+
+static void metrics_thread_init(size_t shard) {
+  Metrics *m = calloc(1, sizeof(Metrics));
+  if (m == NULL) return;
+  m->shard = shard;
+
+  m->all_next = atomic_load_explicit(&metrics_all, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(
+    &metrics_all,
+    &m->all_next,
+    m,
+    memory_order_release,
+    memory_order_relaxed
+  ));
+
+  metrics_local = m;
+}
+
+static void metrics_free(void) {
+  Metrics *m = atomic_exchange(&metrics_all, NULL);
+  while (m) {
+    Metrics *next = m->all_next;
+    free(m);
+    m = next;
+  }
+}
+
+static void metrics_add(_Atomic uint64_t *counter, uint64_t n) {
+  /* only this thread writes it, so this needn't be a locked add */
+  uint64_t v = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, v + n, memory_order_relaxed);
+}
+
+static void metrics_set(_Atomic uint64_t *gauge, uint64_t v) {
+  atomic_store_explicit(gauge, v, memory_order_relaxed);
+}
+
+static uint64_t metrics_get(_Atomic uint64_t *v) {
+  return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+static size_t metrics_hist_bucket(uint64_t us) {
+  if (us < METRICS_HIST_SUB) return us;
+
+  /* which power of two, then which part of it */
+  int e = 63 - __builtin_clzll(us);
+  return (e - METRICS_HIST_SUB_BITS + 1) * METRICS_HIST_SUB +
+         ((us >> (e - METRICS_HIST_SUB_BITS)) & (METRICS_HIST_SUB - 1));
+}
+
+/* everything in bucket i is less than this many us */
+static uint64_t metrics_hist_bound(size_t i) {
+  if (i < METRICS_HIST_SUB) return i + 1;
+
+  int e = i / METRICS_HIST_SUB + METRICS_HIST_SUB_BITS - 1;
+  uint64_t sub = i % METRICS_HIST_SUB;
+  return (METRICS_HIST_SUB + sub + 1) << (e - METRICS_HIST_SUB_BITS);
+}
+
+static void metrics_observe(MetricsHist *h, long long us) {
+  if (us < 0) us = 0;
+
+  size_t i = metrics_hist_bucket(us);
+  if (i < METRICS_HIST_BUCKETS) metrics_add(&h->buckets[i], 1);
+  metrics_add(&h->count, 1);
+  metrics_add(&h->sum_us, us);
+}
+
+static long long metrics_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const struct {
+  const char *name, *type, *help;
+  size_t offset;
+} metrics_scalars[] = {
+  {
+    "cketchbook_connections_accepted_total", "counter",
+    "Connections accepted.",
+    offsetof(Metrics, accepted)
+  },
+  {
+    "cketchbook_points_ingested_total", "counter",
+    "Points sent in by this shard's clients.",
+    offsetof(Metrics, points_ingested)
+  },
+  {
+    "cketchbook_points_broadcast_total", "counter",
+    "Point records (adds, removes, evicts) sent out to rooms.",
+    offsetof(Metrics, points_broadcast)
+  },
+  {
+    "cketchbook_points_evicted_total", "counter",
+    "Points pushed out of a room's history by newer ones.",
+    offsetof(Metrics, points_evicted)
+  },
+  {
+    "cketchbook_received_bytes_total", "counter",
+    "Bytes read from clients.",
+    offsetof(Metrics, bytes_received)
+  },
+  {
+    "cketchbook_sent_bytes_total", "counter",
+    "Bytes written to clients.",
+    offsetof(Metrics, bytes_sent)
+  },
+  {
+    "cketchbook_poll_wakeups_total", "counter",
+    "Times the event loop woke up.",
+    offsetof(Metrics, poll_wakeups)
+  },
+  {
+    "cketchbook_broadcasts_dropped_total", "counter",
+    "Broadcast frames thrown out because a client fell too far behind.",
+    offsetof(Metrics, broadcasts_dropped)
+  },
+  {
+    "cketchbook_resyncs_total", "counter",
+    "Times a client that fell too far behind was sent its room again.",
+    offsetof(Metrics, resyncs)
+  },
+  {
+    "cketchbook_queued_bytes", "gauge",
+    "Bytes waiting in client response queues.",
+    offsetof(Metrics, queued_bytes)
+  },
+  {
+    "cketchbook_queued_bytes_max", "gauge",
+    "Bytes waiting in the longest client response queue.",
+    offsetof(Metrics, queued_bytes_max)
+  },
+  {
+    "cketchbook_rooms", "gauge",
+    "Rooms in memory.",
+    offsetof(Metrics, rooms)
+  },
+};
+
+static const char *metrics_phase_names[METRICS_PHASE_COUNT] = {
+  [ClientPhase_HttpRequesting] = "http_requesting",
+  [ClientPhase_HttpResponding] = "http_responding",
+  [ClientPhase_Websocket]      = "websocket",
+};
+
+static void metrics_render_hist(
+  FILE *out,
+  const char *name,
+  const char *help,
+  size_t offset
+) {
+  /* everyone's added together */
+  uint64_t buckets[METRICS_HIST_BUCKETS] = {0}, count = 0, sum_us = 0;
+  for (Metrics *m = atomic_load(&metrics_all); m; m = m->all_next) {
+    MetricsHist *h = (MetricsHist *)((char *)m + offset);
+    for (size_t i = 0; i < METRICS_HIST_BUCKETS; i++)
+      buckets[i] += metrics_get(&h->buckets[i]);
+    count += metrics_get(&h->count);
+    sum_us += metrics_get(&h->sum_us);
+  }
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+  /* Prometheus wants them cumulative */
+  uint64_t below = 0;
+  for (size_t i = 0; i < METRICS_HIST_BUCKETS; i++) {
+    below += buckets[i];
+    fprintf(
+      out,
+      "%s_bucket{le=\"%.6f\"} %llu\n",
+      name,
+      metrics_hist_bound(i) / 1e6,
+      (unsigned long long)below
+    );
+  }
+
+  /* bucket counts are read one at a time, so don't let +Inf come up short */
+  if (count < below) count = below;
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+  fprintf(out, "%s_sum %.6f\n", name, sum_us / 1e6);
+  fprintf(out, "%s_count %llu\n", name, (unsigned long long)count);
+}
+
+static void metrics_render(FILE *out) {
+  Metrics *all = atomic_load(&metrics_all);
+
+  fprintf(
+    out,
+    "# HELP cketchbook_clients Connected clients, by phase.\n"
+    "# TYPE cketchbook_clients gauge\n"
+  );
+  for (Metrics *m = all; m; m = m->all_next)
+    for (int p = 0; p < METRICS_PHASE_COUNT; p++) {
+      if (metrics_phase_names[p] == NULL) continue;
+      fprintf(
+        out,
+        "cketchbook_clients{shard=\"%zu\",phase=\"%s\"} %llu\n",
+        m->shard,
+        metrics_phase_names[p],
+        (unsigned long long)metrics_get(&m->clients[p])
+      );
+    }
+
+  for (size_t s = 0; s < sizeof(metrics_scalars) / sizeof(*metrics_scalars); s++) {
+    fprintf(
+      out,
+      "# HELP %s %s\n# TYPE %s %s\n",
+      metrics_scalars[s].name,
+      metrics_scalars[s].help,
+      metrics_scalars[s].name,
+      metrics_scalars[s].type
+    );
+    for (Metrics *m = all; m; m = m->all_next)
+      fprintf(
+        out,
+        "%s{shard=\"%zu\"} %llu\n",
+        metrics_scalars[s].name,
+        m->shard,
+        (unsigned long long)metrics_get(
+          (_Atomic uint64_t *)((char *)m + metrics_scalars[s].offset)
+        )
+      );
+  }
+
+  metrics_render_hist(
+    out,
+    "cketchbook_loop_seconds",
+    "Time spent handling one event loop wakeup.",
+    offsetof(Metrics, loop)
+  );
+  metrics_render_hist(
+    out,
+    "cketchbook_fanout_seconds",
+    "Time from a point coming in to it being queued for a shard's clients.",
+    offsetof(Metrics, fanout)
+  );
+}
+
+#endif
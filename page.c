@@ -7,106 +7,311 @@
 #include <errno.h>
 #include <time.h>
 
+/* threads */
+#include <pthread.h>
+#include <stdatomic.h>
+
 /* networking */
 #include <arpa/inet.h>
 #include <signal.h>
 #include <netdb.h>
 
 /* non-blocking io */
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+
+/* io_uring: we talk to it directly, no liburing */
+#if __has_include(<linux/io_uring.h>)
+#define EVENT_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/* the point log */
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define DEBUG 0
 
+/* permessage-deflate */
+#include <zlib.h>
+
 /* hashing/encoding */
 #include "sha1.h"
 #include "base64.h"
 
+/* numbers in and out of text, without stdio */
+#include "ascii.h"
+
 #include "socket.h"
+#include "event.h"
 #include "client.h"
+#include "metrics.h"
 #include "server.h"
 
 
-static volatile bool killed = false;
+static atomic_bool killed = false;
 void interrupt_handler(int _) { killed = true; }
 
-int main() {
-
-  /* I turned this off before adding support for poll,
-   * but after seeing how running the server killed my laptop battery
-   * and pegged out my server CPU, I kept this turned off, because
-   * anytime we're writing to a pipe that isn't ready is a time we
-   * probably weren't aggressive enough with poll */
-  signal(SIGPIPE, SIG_IGN);
+typedef struct {
+  ServerConfig config;
+  Server server;
+  pthread_t thread;
+  int ret;
+} Shard;
 
-  /* I just like freeing all the memory at the end
-   * so that valgrind says I'm a good boy 😇 */
-  signal(SIGINT, interrupt_handler);
+static void *shard_run(void *arg) {
+  Shard *shard = arg;
+  Server *server = &shard->server;
 
-  Server server = {0};
-  if (server_init(&server) < 0) return 1;
+  if (server_init(server, &shard->config) < 0) {
+    shard->ret = 1;
+    /* no point in the rest of them carrying on without us */
+    killed = true;
+    return NULL;
+  }
 
   while (!killed) {
     /**
-     * This blocks indefinitely until there's something that needs doing.
+     * This blocks until there's something that needs doing
+     * (or a deadline comes up, so the sweeps below can run).
      **/
-    server_poll(&server);
+    server_poll(server);
+    long long woke_us = event_now_us();
 
-    /* first see if any clients need responding to */
-    for (Client *next = NULL, *c = server.last_client; c; c = next) {
-      next = c->next;
+    /* only look at the clients that actually have something going on */
+    for (size_t i = 0; i < server->events.ready_count; i++) {
+      EventReady *r = server->events.ready + i;
 
-      short revents = server_client_get_revents(&server, c);
-      if (revents & (POLLHUP | POLLERR)) {
-        server_drop_client(&server, c);
-      } else {
-        server_step_client(&server, c);
+      /* dropped while we were handling an earlier entry */
+      if (r->src == NULL) continue;
+
+      /* now poll for new clients */
+      if (r->src == &server->host_ev) {
+        server_accept_clients(server);
+        continue;
+      }
+
+      /* points from the other shards */
+      if (r->src == &server->wake_ev) {
+        server_shard_drain(server);
+        continue;
       }
-    }
 
-    printf("\nCLIENT COUNT: %zu\n", server_client_count(&server));
-    for (Client *c = server.last_client; c; c = c->next) {
-      printf("client! id: %zu phase: ", c->id);
-
-      switch (c->phase) {
-        case ClientPhase_Empty         : printf("ClientPhase_Empty         \n"); continue;
-        case ClientPhase_HttpResponding: printf("ClientPhase_HttpResponding\n"); continue;
-        case ClientPhase_Websocket     : printf("ClientPhase_Websocket     \n"); continue;
-        case ClientPhase_HttpRequesting:
-          printf(
-            "ClientPhase_HttpRequesting"
-              "(bytes_read: %zu, buf_len: %zu)\n",
-            c->http_req.bytes_read,
-            c->http_req.buf_len
-          );
-          continue;
-        default: printf("Unknown phase!\n"); continue;
+      Client *c = r->src->udata;
+      if (r->revents & (POLLHUP | POLLERR)) {
+        server_drop_client(server, c);
+      } else {
+        server_step_client(server, c);
       }
     }
 
-    /* now poll for new clients */
-    if (server_new_client_revent(&server))
-      for (;;) {
-        int fd = socket_accept_client(server.host_fd);
-        if (fd < 0) {
-          if (errno == EWOULDBLOCK || errno == EAGAIN)
-            break;
-          else
+    /* everything that came in this time around goes out together */
+    server_flush_batch(server);
+
+    /* whoever's timed out or due a ping */
+    server_expire_clients(server);
+
+    /* once a second, look over the rooms */
+    if (event_now_ms() - server->last_sweep >= SERVER_SWEEP_MS) {
+      server_sweep(server);
+
+      printf("\nCLIENT COUNT: %zu\n", server_client_count(server));
+
+      /* these should sit still while points are going out */
+      ClientPoolMisses misses = client_pool_misses();
+      printf(
+        "POOL MISSES: frames %zu, responses %zu, clients %zu\n",
+        misses.frames,
+        misses.responses,
+        misses.clients
+      );
+      for (Client *c = server->last_client; c; c = c->next) {
+        printf("client! id: %zu phase: ", c->id);
+
+        switch (c->phase) {
+          case ClientPhase_Empty         : printf("ClientPhase_Empty         \n"); continue;
+          case ClientPhase_HttpResponding: printf("ClientPhase_HttpResponding\n"); continue;
+          case ClientPhase_Websocket     : printf("ClientPhase_Websocket     \n"); continue;
+          case ClientPhase_HttpRequesting:
+            printf(
+              "ClientPhase_HttpRequesting"
+                "(bytes_read: %zu, buffered: %zu)\n",
+              c->http_req.bytes_read,
+              c->recv.end - c->recv.start
+            );
             continue;
+          default: printf("Unknown phase!\n"); continue;
         }
+      }
+    }
+
+    /* the only clock read besides the one waking up, and it leaves
+     * server_poll working out its timeout from now */
+    event_clock_tick();
+    metrics_observe(&metrics_local->loop, event_now_us() - woke_us);
+
+  }
+
+  server_free(server);
+  return NULL;
+}
+
+/* all of s as a number in [min, max], or false */
+static bool parse_long(const char *s, long min, long max, long *out) {
+  char *end;
+  errno = 0;
+  long v = strtol(s, &end, 10);
+  if (end == s || *end || errno == ERANGE || v < min || v > max)
+    return false;
+  *out = v;
+  return true;
+}
+
+static bool parse_double(const char *s, double min, double max, double *out) {
+  char *end;
+  errno = 0;
+  double v = strtod(s, &end);
+  /* written so NaN fails it too */
+  if (end == s || *end || errno == ERANGE || !(v >= min && v <= max))
+    return false;
+  *out = v;
+  return true;
+}
+
+int main(int argc, char **argv) {
+  ServerConfig config = {
+    .backend = EventBackend_Default,
+    .threads = 1,
+    .coalesce_ms = -1,
+    .history_points = POINT_COUNT,
+  };
 
-        server_add_client(&server, fd);
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--backend=", 10) == 0) {
+      int parsed = event_backend_parse(argv[i] + 10);
+      if (parsed < 0) {
+        fprintf(stderr, "unknown backend: %s\n", argv[i] + 10);
+        return 1;
       }
+      config.backend = parsed;
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      long threads;
+      if (!parse_long(argv[i] + 10, 1, INT_MAX, &threads)) {
+        fprintf(stderr, "bad thread count: %s\n", argv[i] + 10);
+        return 1;
+      }
+      config.threads = threads;
+    } else if (strncmp(argv[i], "--history=", 10) == 0) {
+      long points;
+      if (!parse_long(argv[i] + 10, 1, INT32_MAX, &points)) {
+        fprintf(stderr, "bad history size: %s\n", argv[i] + 10);
+        return 1;
+      }
+      config.history_points = points;
+    } else if (strncmp(argv[i], "--history-budget=", 17) == 0) {
+      /* in MB, and 0 is no budget; the max keeps the << 20 in a size_t */
+      long mb;
+      long max = SIZE_MAX >> 20 < LONG_MAX ? (long)(SIZE_MAX >> 20) : LONG_MAX;
+      if (!parse_long(argv[i] + 17, 0, max, &mb)) {
+        fprintf(stderr, "bad history budget: %s\n", argv[i] + 17);
+        return 1;
+      }
+      config.history_budget = (size_t)mb << 20;
+    } else if (strcmp(argv[i], "--simplify") == 0) {
+      config.simplify_px = 1.5;
+    } else if (strncmp(argv[i], "--simplify=", 11) == 0) {
+      /* 0 is off, and past the coordinates' range every stroke is a line */
+      if (!parse_double(
+        argv[i] + 11,
+        0,
+        CLIENTPOINT_COORD_MAX,
+        &config.simplify_px
+      )) {
+        fprintf(stderr, "bad simplify tolerance: %s\n", argv[i] + 11);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--log=", 6) == 0) {
+      config.log_dir = argv[i] + 6;
+    } else if (strcmp(argv[i], "--coalesce") == 0) {
+      config.coalesce_ms = 0;
+    } else if (strncmp(argv[i], "--coalesce=", 11) == 0) {
+      long ms;
+      if (!parse_long(argv[i] + 11, 0, INT_MAX, &ms)) {
+        fprintf(stderr, "bad coalesce window: %s\n", argv[i] + 11);
+        return 1;
+      }
+      config.coalesce_ms = ms;
+    } else {
+      fprintf(
+        stderr,
+        "usage: %s [--backend=poll|epoll|io_uring] [--threads=n]"
+          " [--coalesce[=ms]] [--history=points] [--history-budget=MB]"
+          " [--simplify[=px]] [--log=dir]\n",
+        argv[0]
+      );
+      return 1;
+    }
+  }
 
+  /* I turned this off before adding support for poll,
+   * but after seeing how running the server killed my laptop battery
+   * and pegged out my server CPU, I kept this turned off, because
+   * anytime we're writing to a pipe that isn't ready is a time we
+   * probably weren't aggressive enough with poll */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* I just like freeing all the memory at the end
+   * so that valgrind says I'm a good boy 😇 */
+  signal(SIGINT, interrupt_handler);
+
+  /* every shard after the first gets a thread of its own */
+  ServerShards shards = {0};
+  if (config.threads > 1 && server_shards_init(&shards, config.threads) < 0) {
+    server_shards_free(&shards);
+    return 1;
   }
 
-  server_free(&server);
+  Shard *all = calloc(config.threads, sizeof(Shard));
+  for (int i = 0; i < config.threads; i++) {
+    all[i].config = config;
+    if (config.threads > 1) {
+      all[i].config.shards = &shards;
+      all[i].config.shard = i;
+    }
+  }
+
+  for (int i = 1; i < config.threads; i++)
+    pthread_create(&all[i].thread, NULL, shard_run, &all[i]);
+  shard_run(&all[0]);
+  for (int i = 1; i < config.threads; i++)
+    pthread_join(all[i].thread, NULL);
+
+  int ret = 0;
+  for (int i = 0; i < config.threads; i++)
+    ret |= all[i].ret;
+
+  free(all);
+  server_shards_free(&shards);
+  metrics_free();
+  return ret;
 }
 
 #define socket_IMPLEMENTATION
 #include "socket.h"
 #define base64_IMPLEMENTATION
 #include "base64.h"
+#define ascii_IMPLEMENTATION
+#include "ascii.h"
+#define event_IMPLEMENTATION
+#include "event.h"
+#define metrics_IMPLEMENTATION
+#include "metrics.h"
 #define server_IMPLEMENTATION
 #include "server.h"
 #define client_IMPLEMENTATION
@@ -6,38 +6,410 @@ typedef enum {
   ClientPointAction_None,
   ClientPointAction_Add,
   ClientPointAction_Remove,
+  /* only `seq` means anything: every point older than it is gone */
+  ClientPointAction_Evict,
 } ClientPointAction;
 typedef struct {
   ClientPointAction action;
   size_t client_id, path_id;
   double x, y;
+  /**
+   * Counts up by one for every point a room takes in (on each shard, so
+   * it's only the same between clients of the same shard). Clients
+   * keep their paths in this order, and it's how a Remove or an Evict
+   * says which points it means. Wraps after 4 billion or so points.
+   **/
+  uint32_t seq;
 } ClientPoint;
 
+/**
+ * The binary (opcode 2) encoding of a ClientPoint, little endian:
+ *
+ *   to clients:   u8 action, u32 client_id, u32 path_id, i16 x, i16 y, u32 seq
+ *   from clients:            u32 path_id, i16 x, i16 y
+ *
+ * Coordinates are rounded to whole (device) pixels. The text encoding
+ * is the same fields, comma separated.
+ **/
+#define CLIENTPOINT_PACKED_SIZE 17
+#define CLIENTPOINT_PACKED_IN_SIZE 8
+
+/**
+ * Points further out than this either way are turned away, in either
+ * encoding: it's as far as an i16 goes (both ways), and anything past
+ * it couldn't be sent on to binary clients anyway.
+ **/
+#define CLIENTPOINT_COORD_MAX INT16_MAX
+
+/* how many points a room remembers, unless --history says otherwise */
 #define POINT_COUNT 2269
+
+#include "server_log.h"
+
+/**
+ * Points one shard took in, on their way to one other shard. Only one
+ * thread ever pushes and only one ever pops, so the two counters are
+ * all the synchronization it needs. They get a cache line each, so the
+ * two ends aren't fighting over one.
+ **/
+#define SERVER_SHARD_QUEUE_SIZE (1 << 12)
+typedef struct {
+  char room[CLIENT_WS_ROOM_MAX + 1];
+  ClientPoint cp;
+  /* event_now_us() when it came in, for Metrics.fanout */
+  long long ingest_us;
+} ServerShardMsg;
+typedef struct {
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+  ServerShardMsg msgs[SERVER_SHARD_QUEUE_SIZE];
+} ServerShardQueue;
+
+typedef struct {
+  /* inbox[i] has what shard i sent us */
+  ServerShardQueue *inbox;
+  /* [0] sits in our event loop, the others send a byte into [1] */
+  int wake_fds[2];
+  /* so a burst of points only costs one wakeup */
+  atomic_bool wake_pending;
+} ServerShard;
+
+/**
+ * With --threads, every thread runs a whole Server of its own: its own
+ * listener on the same port (SO_REUSEPORT spreads connections between
+ * them), its own clients and event loop, and its own copy of the point
+ * history. Points a shard takes in get passed to all the others, which
+ * is the only thing they share.
+ **/
+typedef struct {
+  size_t count;
+  ServerShard *shards;
+} ServerShards;
+
+typedef struct {
+  EventBackend backend;
+  /* how many shards to run, one thread each */
+  int threads;
+
+  /**
+   * -1 sends every point out as soon as it comes in.
+   *  0 batches up everything from one trip around the event loop.
+   *  Anything higher holds points for up to that many ms, so each
+   *  peer gets one frame for the whole burst.
+   **/
+  int coalesce_ms;
+
+  /* how many points each room remembers */
+  size_t history_points;
+  /**
+   * How many bytes of ServerChunks all of a shard's rooms get to share,
+   * 0 for no limit. Once it's used up, rooms that would like to grow
+   * start reusing their oldest slots instead. Rooms with a log always
+   * get all of history_points, the same as the file has room for.
+   **/
+  size_t history_budget;
+
+  /**
+   * How far (in pixels) a point can be from the line through its
+   * neighbours and still get dropped when its path is simplified,
+   * 0 to keep every point. See server_room_simplify.
+   **/
+  double simplify_px;
+
+  /**
+   * Where to keep each room's points between runs (see server_log.h),
+   * NULL to keep them in memory only. With more than one shard, only
+   * the first writes to the logs; the rest read them in when a room
+   * is made.
+   **/
+  const char *log_dir;
+
+  /* which shard this is, set up by main when there's more than one */
+  ServerShards *shards;
+  size_t shard;
+} ServerConfig;
+
+/* the longest a text record can get, three integers, two doubles and a seq */
+#define CLIENTPOINT_TEXT_MAX \
+  (ASCII_I64_MAX + 3 * ASCII_U64_MAX + 2 * ASCII_DOUBLE_MAX + 5 * 2)
+
+/**
+ * A point encoded for each ClientWsFormat, but not framed yet. It has
+ * room for both right in it, so encoding one never touches the heap;
+ * they only ever live on the stack for as long as it takes to copy
+ * them somewhere else.
+ **/
+typedef struct {
+  char *payload[ClientWsFormat_COUNT];
+  size_t payload_len[ClientWsFormat_COUNT];
+
+  char text[CLIENTPOINT_TEXT_MAX];
+  uint8_t binary[CLIENTPOINT_PACKED_SIZE];
+} ServerEncodedPoint;
+
+/**
+ * Points waiting to go out together, in one format. Records are
+ * packed into as few frames as they'll fit in; `frames` has the
+ * full ones and `payload` the one we're still adding to.
+ **/
+typedef struct ServerBatch {
+  /* compress each frame, for clients with permessage-deflate */
+  bool deflate;
+
+  char *frames;
+  size_t frames_len, frames_cap;
+
+  char payload[CLIENT_WS_PAYLOAD_MAX];
+  size_t payload_len;
+} ServerBatch;
+
+/**
+ * Every point in a room's ring, oldest first, already encoded and
+ * ready to go out to whoever joins next. Appended to as points come
+ * in, trimmed from the front as the ring overwrites them (each slot
+ * remembers how long its record was, see ServerChunk). Text records
+ * are kept one per line.
+ **/
+typedef struct {
+  char *buf;
+  size_t start, end, cap;
+  /* how many bytes have been slid off the front of buf, all told */
+  uint64_t base;
+  /**
+   * What we hand out to joiners, framed up into as few messages as it
+   * fits in, until the history changes. [1] is compressed, for the
+   * ones with permessage-deflate; it's built once for all of them.
+   **/
+  ClientFrame *frame[2];
+} ServerHistory;
+
+/**
+ * Which points are where, so a client that can only see part of the
+ * canvas only gets sent that part. The canvas is cut up into squares
+ * SERVER_GRID_CELL pixels across, and every cell keeps a list of the
+ * points that are in it; anything off the edge of the grid counts as
+ * being in the nearest cell. The page does the same math, so it knows
+ * which points it should forget when its view changes.
+ **/
+#define SERVER_GRID_CELL 256
+#define SERVER_GRID_SIZE 32
 typedef struct {
-  ClientPoint points[POINT_COUNT];
-  size_t points_i;
+  /* first slot of the ring in each cell, -1 if there's none */
+  int32_t head[SERVER_GRID_SIZE * SERVER_GRID_SIZE];
+} ServerGrid;
+
+/**
+ * A room's ring of points is made up of chunks of SERVER_CHUNK_POINTS
+ * slots, and only has as many of them as it's needed so far, so a room
+ * nobody draws in costs next to nothing and a busy one can hold
+ * millions of points. Each chunk is one allocation with everything we
+ * keep for its slots, so finding a slot is a shift and a mask no matter
+ * how big the ring gets.
+ **/
+#define SERVER_CHUNK_SHIFT 10
+#define SERVER_CHUNK_POINTS (1 << SERVER_CHUNK_SHIFT)
+typedef struct {
+  /* in the room's log if it has one, otherwise `own` */
+  ClientPoint *points;
+  /* where each slot's record is in ServerHistory.buf (past its base) */
+  uint64_t history_at[ClientWsFormat_COUNT][SERVER_CHUNK_POINTS];
+  /* and how many bytes it takes up */
+  uint16_t history_len[ClientWsFormat_COUNT][SERVER_CHUNK_POINTS];
+  /* the lists hanging off of ServerGrid.head */
+  int32_t grid_next[SERVER_CHUNK_POINTS], grid_prev[SERVER_CHUNK_POINTS];
+  uint16_t grid_cell[SERVER_CHUNK_POINTS];
+  ClientPoint own[];
+} ServerChunk;
+
+/* a text record and its newline, the longest one history_len holds */
+_Static_assert(
+  CLIENTPOINT_TEXT_MAX + 1 <= UINT16_MAX,
+  "ServerChunk.history_len can't hold the longest text record"
+);
+
+/* for broadcasts that aren't about any one spot, so everybody gets them */
+#define SERVER_CELL_ANY -2
+
+/* a client's view, in cells, inclusive on both ends */
+typedef struct {
+  int x0, y0, x1, y1;
+} ServerView;
+
+/**
+ * A path someone is still drawing (or was, up until recently): which
+ * slots its points are in, so it can be simplified once it's done.
+ **/
+#define SERVER_PATH_IDLE_MS 1000
+typedef struct {
+  size_t client_id, path_id;
+  long long last_ms;
+  size_t *slots, slot_count, slot_cap;
+} ServerPath;
+
+/**
+ * One canvas. Clients pick one with /chat/<room> (plain /chat is the ""
+ * room), and points only go out to, and are only kept for, the room
+ * they were drawn in. Rooms are made the first time anyone asks for
+ * one, and freed once nobody has been in or drawn in them for
+ * SERVER_ROOM_IDLE_SECS (with --threads and no --log, only if nothing
+ * was ever drawn in them). The "" room sticks around like it always has.
+ **/
+#define SERVER_ROOM_IDLE_SECS (10 * 60)
+#define SERVER_ROOM_BUCKETS 64
+typedef struct ServerRoom {
+  /* next in the same bucket of Server.rooms */
+  struct ServerRoom *next;
+  char name[CLIENT_WS_ROOM_MAX + 1];
+
+  ServerChunk **chunks;
+  size_t chunk_count, chunk_bytes;
+  /* how many slots the ring has so far, and where the next point goes */
+  size_t points_cap, points_i;
+  /* once it's wrapped around, it stays the size it is */
+  bool points_full;
+  ServerLog log;
+
+  /* the next point's ClientPoint.seq */
+  uint32_t seq_next;
+  /**
+   * Points pushed out of the ring aren't announced one by one; every so
+   * often, the room gets one Evict for everything below evict_seq.
+   **/
+  uint32_t evict_seq, evict_sent;
+
+  /* only tracked with config.simplify_px */
+  ServerPath *paths;
+  size_t path_count, path_cap;
+  /* slots emptied out by simplifying, that haven't been reclaimed yet */
+  size_t dropped;
+  /* one for each format clients can ask for */
+  ServerHistory history[ClientWsFormat_COUNT];
+  ServerGrid grid;
+
+  /* linked through Client.room_next */
+  Client *members;
+  size_t member_count;
+  /* when someone last left or drew something, event_now_ms() */
+  long long last_active;
+
+  /**
+   * Only used if config.coalesce_ms >= 0, and only for members who see
+   * everything; the ones with a view have a Client.view_batch each.
+   **/
+  ServerBatch batch[ClientWsFormat_COUNT];
+  /* when each of the new points in batch came in, for Metrics.fanout */
+  long long *batch_ingest_us;
+  size_t batch_ingest_count, batch_ingest_cap;
+} ServerRoom;
+
+/**
+ * Every client with a deadline coming up (see client_deadline), hashed
+ * into a ring of slots by when it is, so a wakeup only has to look at
+ * the slots whose time has come instead of at everyone. A deadline
+ * further out than the ring goes around just sits in its slot for
+ * another lap.
+ *
+ * All of them are a few seconds out at most, so one level is plenty.
+ **/
+#define SERVER_WHEEL_TICK_MS 64
+#define SERVER_WHEEL_SLOTS 128
+
+typedef struct {
+  /* linked through Client.wheel_next */
+  Client *slots[SERVER_WHEEL_SLOTS];
+  size_t count;
+  /* the next tick to look at; everything before it has been */
+  long long tick;
+} ServerWheel;
+
+typedef struct {
+  ServerConfig config;
+
+  /* hashed on the name */
+  ServerRoom *rooms[SERVER_ROOM_BUCKETS];
+  size_t room_count;
 
   int host_fd;
-  size_t client_id_i;
+  EventSource host_ev;
+
+  size_t client_id_i, client_count;
   /* The head of the linked list of clients */
   Client *last_client;
 
-  struct pollfd *pollfds;
-  nfds_t pollfd_count;
+  EventLoop events;
+  /* woken by other shards when they've sent us points */
+  EventSource wake_ev;
+  /* client timeouts and pings */
+  ServerWheel wheel;
+  /* when we last looked over the rooms, event_now_ms() */
+  long long last_sweep;
+
+  /* when the rooms' batches have to go out, in event_now_ms() time */
+  long long batch_deadline;
+
+  /* the "" room's log header, if we write it; see client_id_next */
+  ServerLogHeader *ids_log;
+
+  /* how much of config.history_budget the rooms are using */
+  size_t chunk_bytes;
+
+  /**
+   * event_now_us() when the point being taken in right now first
+   * came in, 0 if what's going out isn't a new point.
+   **/
+  long long ingest_us;
+  /**
+   * The ingest_us of points sent straight out (no --coalesce) since
+   * the last server_flush_batch, which reads the clock once for all
+   * of them.
+   **/
+  long long *fanout_us;
+  size_t fanout_count, fanout_cap;
 } Server;
 
-static int server_init(Server *server);
+static int server_init(Server *server, ServerConfig *config);
 static void server_free(Server *server);
 
 /**
- * wait indefinitely until there is work to be done!
+ * wait until there is work to be done!
+ * what's ready ends up in server->events.ready
  **/
 static void server_poll(Server *server);
 
-/* these functions help you process the output of the poll */
-static short server_new_client_revent(Server *server);
-static short server_client_get_revents(Server *server, Client *c);
+/**
+ * Sends out whatever points have been batched up, if it's time, and
+ * records Metrics.fanout for everything that's gone out.
+ **/
+static void server_flush_batch(Server *server);
+
+static int server_shards_init(ServerShards *shards, size_t count);
+static void server_shards_free(ServerShards *shards);
+/* takes in everything the other shards have sent us */
+static void server_shard_drain(Server *server);
+
+/* accept everyone waiting on the host socket */
+static void server_accept_clients(Server *server);
+
+/**
+ * Steps the clients whose deadlines have come (timeouts, pings),
+ * whether or not anything's ready on their sockets.
+ **/
+static void server_expire_clients(Server *server);
+/* once a second is plenty for the rooms */
+#define SERVER_SWEEP_MS 1000
+static void server_sweep(Server *server);
+
+/* NULL if it doesn't exist and `create` isn't set */
+static ServerRoom *server_room_find(
+  Server *server,
+  const char *name,
+  bool create
+);
+/* frees rooms that have been empty and quiet for long enough */
+static void server_sweep_rooms(Server *server);
+
+/* lets the event loop know if what a client is waiting on changed */
+static void server_client_sync_events(Server *server, Client *c);
 
 static size_t server_client_count(Server *server);
 static void server_add_client(Server *server, int net_fd);
@@ -52,13 +424,58 @@ static void server_drop_client(Server *server, Client *c);
 
 #ifdef server_IMPLEMENTATION
 
-static int server_init(Server *server) {
-  server->host_fd = socket_host_bind(NULL, "8081");
+#include "server_log.h"
+
+static void server_history_changed(ServerHistory *h);
+static void server_room_load(Server *server, ServerRoom *room);
+static void server_room_simplify(Server *server, ServerRoom *room);
+static void server_room_send_evict(Server *server, ServerRoom *room);
+static void server_room_free(Server *server, ServerRoom *room);
+static void server_room_leave(Client *c);
+
+static int server_init(Server *server, ServerConfig *config) {
+  server->config = *config;
+  metrics_thread_init(config->shard);
+  server->host_fd = socket_host_bind(NULL, "8081", config->shards != NULL);
 
   if (server->host_fd < 0) {
     return -1;
   }
 
+  if (event_init(&server->events, config->backend) < 0) {
+    /* poll is always there to fall back on */
+    fprintf(stderr, "couldn't start event backend, falling back to poll\n");
+    event_free(&server->events);
+    event_init(&server->events, EventBackend_Poll);
+  }
+
+  server->host_ev = (EventSource) { .fd = server->host_fd };
+  if (event_add_listener(&server->events, &server->host_ev) < 0) {
+    event_free(&server->events);
+    close(server->host_fd);
+    return -1;
+  }
+
+  if (config->shards) {
+    ServerShard *me = &config->shards->shards[config->shard];
+    server->wake_ev = (EventSource) { .fd = me->wake_fds[0] };
+    if (event_add(&server->events, &server->wake_ev, POLLIN) < 0) {
+      event_free(&server->events);
+      close(server->host_fd);
+      return -1;
+    }
+  }
+
+  /* if this doesn't work out, nobody gets offered compression */
+  client_ws_zlib_init();
+  client_http_init();
+
+  /* so whatever was drawn before a restart is there from the start */
+  server_room_find(server, "", true);
+
+  server->last_sweep = event_now_ms();
+  server->wheel.tick = event_now_ms() / SERVER_WHEEL_TICK_MS;
+
   return 0;
 }
 
@@ -72,66 +489,388 @@ static void server_free(Server *server) {
 
   close(server->host_fd);
 
-  free(server->pollfds);
+  event_free(&server->events);
+
+  for (int i = 0; i < SERVER_ROOM_BUCKETS; i++)
+    for (ServerRoom *next = NULL, *r = server->rooms[i]; r; r = next) {
+      next = r->next;
+      server_room_free(server, r);
+    }
+
+  free(server->fanout_us);
+  client_ws_zlib_free();
+  client_pool_free();
+}
+
+static void server_wheel_add(Server *server, Client *c, long long at) {
+  ServerWheel *w = &server->wheel;
+
+  /* anything that's already late goes in the next slot to be looked at */
+  long long tick = at / SERVER_WHEEL_TICK_MS;
+  if (tick < w->tick) tick = w->tick;
+
+  Client **slot = &w->slots[tick % SERVER_WHEEL_SLOTS];
+  c->wheel_at = at;
+  c->wheel_next = *slot;
+  c->wheel_pprev = slot;
+  if (*slot) (*slot)->wheel_pprev = &c->wheel_next;
+  *slot = c;
+  w->count++;
+}
+
+static void server_wheel_remove(Server *server, Client *c) {
+  if (c->wheel_at == 0) return;
+
+  *c->wheel_pprev = c->wheel_next;
+  if (c->wheel_next) c->wheel_next->wheel_pprev = c->wheel_pprev;
+
+  c->wheel_at = 0;
+  c->wheel_next = NULL;
+  c->wheel_pprev = NULL;
+  server->wheel.count--;
 }
 
-static short server_new_client_revent(Server *server) {
-  /* first fd is always the socket */
-  return server->pollfds[0].revents;
+/* puts them where their next deadline is, or nowhere if there isn't one */
+static void server_wheel_schedule(Server *server, Client *c) {
+  long long at = client_deadline(c);
+  if (at == c->wheel_at) return;
+
+  server_wheel_remove(server, c);
+  if (at) server_wheel_add(server, c, at);
 }
 
-static short server_client_get_revents(Server *server, Client *c) {
-  for (int i = 0; i < server->pollfd_count; i++)
-    if (server->pollfds[i].fd == c->net_fd)
-      return server->pollfds[i].revents;
+/* when the first non-empty slot comes due, 0 if they're all empty */
+static long long server_wheel_next(Server *server) {
+  ServerWheel *w = &server->wheel;
+  if (w->count == 0) return 0;
+
+  for (long long t = w->tick; t < w->tick + SERVER_WHEEL_SLOTS; t++)
+    if (w->slots[t % SERVER_WHEEL_SLOTS])
+      return (t + 1) * SERVER_WHEEL_TICK_MS;
   return 0;
 }
 
+static void server_expire_clients(Server *server) {
+  ServerWheel *w = &server->wheel;
+  long long now = event_now_ms();
+
+  /* a slot's done once the tick after it has started */
+  long long now_tick = now / SERVER_WHEEL_TICK_MS;
+  if (now_tick - w->tick > SERVER_WHEEL_SLOTS)
+    w->tick = now_tick - SERVER_WHEEL_SLOTS;
+
+  while (w->tick < now_tick) {
+    Client **slot = &w->slots[w->tick % SERVER_WHEEL_SLOTS];
+    Client *c = *slot;
+    *slot = NULL;
+    w->tick++;
+
+    /* stepping them puts them back wherever they're due next */
+    for (Client *next = NULL; c; c = next) {
+      next = c->wheel_next;
+
+      long long at = c->wheel_at;
+      c->wheel_at = 0;
+      c->wheel_next = NULL;
+      c->wheel_pprev = NULL;
+      w->count--;
+
+      if (at <= now) server_step_client(server, c);
+      else           server_wheel_add(server, c, at);
+    }
+  }
+}
+
 static void server_poll(Server *server) {
-restart:
-  server->pollfd_count = 1 + server_client_count(server);
-  server->pollfds = reallocarray(
-    server->pollfds,
-    server->pollfd_count,
-    sizeof(struct pollfd)
-  );
+  printf("polling ... %lld\n", event_now_ms() / 1000);
 
-  struct pollfd *fd_w = server->pollfds;
+  /* wake up in time for the next sweep, */
+  long long wake = server->last_sweep + SERVER_SWEEP_MS;
 
-  /* first fd is always the socket */
-  *fd_w++ = (struct pollfd) { .events = POLLIN, .fd = server->host_fd };
+  /* the next client deadline, */
+  long long next = server_wheel_next(server);
+  if (next && next < wake) wake = next;
 
-  /* create pollfds for our clients */
-  for (Client *c = server->last_client; c; c = c->next)
-    *fd_w++ = (struct pollfd) {
-      .events = client_events_subscription(c),
-      .fd = c->net_fd
-    };
+  /* and to send out a batch that's waiting */
+  if (server->batch_deadline && server->batch_deadline < wake)
+    wake = server->batch_deadline;
 
-  printf("polling ... %lu\n", time(NULL));
-  size_t updated = poll(server->pollfds, server->pollfd_count, -1);
-  if (updated < 0) {
-    perror("poll():");
-    goto restart;
+  long long until = wake - event_now_ms();
+  if (until < 0) until = 0;
+
+  /* on error (e.g. EINTR) we just come back with nothing ready */
+  event_wait(&server->events, until);
+  metrics_add(&metrics_local->poll_wakeups, 1);
+}
+
+static void server_accept_clients(Server *server) {
+  for (;;) {
+    int fd = event_accept(&server->host_ev);
+    if (fd < 0) {
+      if (errno == EWOULDBLOCK || errno == EAGAIN)
+        break;
+      else
+        continue;
+    }
+
+    server_add_client(server, fd);
+  }
+}
+
+/* the gauges in Metrics, which are cheaper to count up now and then */
+static void server_sample_metrics(Server *server) {
+  uint64_t clients[METRICS_PHASE_COUNT] = {0};
+  uint64_t queued = 0, queued_max = 0;
+  for (Client *c = server->last_client; c; c = c->next) {
+    if (c->phase < METRICS_PHASE_COUNT) clients[c->phase]++;
+    queued += c->res_bytes;
+    if (c->res_bytes > queued_max) queued_max = c->res_bytes;
   }
+
+  for (int p = 0; p < METRICS_PHASE_COUNT; p++)
+    metrics_set(&metrics_local->clients[p], clients[p]);
+  metrics_set(&metrics_local->queued_bytes, queued);
+  metrics_set(&metrics_local->queued_bytes_max, queued_max);
+  metrics_set(&metrics_local->rooms, server->room_count);
+}
+
+static void server_sweep(Server *server) {
+  server->last_sweep = event_now_ms();
+  server_sweep_rooms(server);
+  server_sample_metrics(server);
+}
+
+static int server_grid_axis(double v) {
+  /* in double first, since converting one that doesn't fit an int is
+   * undefined; NaN fails both and ends up in the first cell */
+  if (!(v >= 0)) return 0;
+  if (!(v < SERVER_GRID_CELL * SERVER_GRID_SIZE)) return SERVER_GRID_SIZE - 1;
+  return v / SERVER_GRID_CELL;
+}
+
+static int server_grid_cell(ClientPoint *cp) {
+  return server_grid_axis(cp->y) * SERVER_GRID_SIZE + server_grid_axis(cp->x);
+}
+
+/* where a slot of the ring is: its chunk, and where it is in there */
+static ServerChunk *server_room_chunk(ServerRoom *room, size_t slot) {
+  return room->chunks[slot >> SERVER_CHUNK_SHIFT];
+}
+#define SERVER_CHUNK_I(slot) ((slot) & (SERVER_CHUNK_POINTS - 1))
+
+static ClientPoint *server_room_point(ServerRoom *room, size_t slot) {
+  return &server_room_chunk(room, slot)->points[SERVER_CHUNK_I(slot)];
+}
+
+static int32_t *server_grid_next(ServerRoom *room, size_t slot) {
+  return &server_room_chunk(room, slot)->grid_next[SERVER_CHUNK_I(slot)];
+}
+
+static int32_t *server_grid_prev(ServerRoom *room, size_t slot) {
+  return &server_room_chunk(room, slot)->grid_prev[SERVER_CHUNK_I(slot)];
+}
+
+static void server_grid_insert(ServerRoom *room, size_t slot, int cell) {
+  int32_t head = room->grid.head[cell];
+
+  server_room_chunk(room, slot)->grid_cell[SERVER_CHUNK_I(slot)] = cell;
+  *server_grid_prev(room, slot) = -1;
+  *server_grid_next(room, slot) = head;
+  if (head >= 0) *server_grid_prev(room, head) = slot;
+  room->grid.head[cell] = slot;
+}
+
+static void server_grid_remove(ServerRoom *room, size_t slot) {
+  int cell = server_room_chunk(room, slot)->grid_cell[SERVER_CHUNK_I(slot)];
+  int32_t prev = *server_grid_prev(room, slot);
+  int32_t next = *server_grid_next(room, slot);
+
+  if (prev >= 0) *server_grid_next(room, prev) = next;
+  else           room->grid.head[cell] = next;
+  if (next >= 0) *server_grid_prev(room, next) = prev;
+}
+
+/* false if they haven't said, which means they see everything */
+static bool server_client_view(Client *c, ServerView *view) {
+  if (!c->ws_view.set) return false;
+
+  *view = (ServerView) {
+    .x0 = server_grid_axis(c->ws_view.x0),
+    .y0 = server_grid_axis(c->ws_view.y0),
+    .x1 = server_grid_axis(c->ws_view.x1),
+    .y1 = server_grid_axis(c->ws_view.y1),
+  };
+  return true;
+}
+
+static bool server_view_has(ServerView *view, int cell) {
+  int x = cell % SERVER_GRID_SIZE, y = cell / SERVER_GRID_SIZE;
+  return x >= view->x0 && x <= view->x1 && y >= view->y0 && y <= view->y1;
+}
+
+/* should a point in this cell go out to them? */
+static bool server_client_sees(Client *c, int cell) {
+  if (cell == SERVER_CELL_ANY) return true;
+
+  ServerView view;
+  return !server_client_view(c, &view) || server_view_has(&view, cell);
+}
+
+static size_t server_room_bucket(const char *name) {
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  for (; *name; name++) hash = (hash ^ (uint8_t)*name) * 16777619u;
+  return hash % SERVER_ROOM_BUCKETS;
+}
+
+static ServerRoom *server_room_find(
+  Server *server,
+  const char *name,
+  bool create
+) {
+  ServerRoom **bucket = &server->rooms[server_room_bucket(name)];
+  for (ServerRoom *r = *bucket; r; r = r->next)
+    if (strcmp(r->name, name) == 0)
+      return r;
+
+  if (!create) return NULL;
+
+  ServerRoom *r = calloc(sizeof(ServerRoom), 1);
+  strcpy(r->name, name);
+  memset(r->grid.head, -1, sizeof(r->grid.head));
+  server_room_load(server, r);
+  r->last_active = event_now_ms();
+  r->next = *bucket;
+  *bucket = r;
+  server->room_count++;
+
+  return r;
+}
+
+static void server_room_free(Server *server, ServerRoom *room) {
+  for (int i = 0; i < ClientWsFormat_COUNT; i++) {
+    server_history_changed(&room->history[i]);
+    free(room->history[i].buf);
+    free(room->batch[i].frames);
+  }
+  free(room->batch_ingest_us);
+  for (size_t i = 0; i < room->chunk_count; i++) free(room->chunks[i]);
+  free(room->chunks);
+  for (size_t i = 0; i < room->path_count; i++) free(room->paths[i].slots);
+  free(room->paths);
+  server->chunk_bytes -= room->chunk_bytes;
+  server_log_close(&room->log);
+  free(room);
+}
+
+static void server_room_join(Server *server, Client *c) {
+  ServerRoom *room = server_room_find(server, c->ws_room, true);
+
+  c->room = room;
+  c->room_prev = NULL;
+  c->room_next = room->members;
+  if (room->members) room->members->room_prev = c;
+  room->members = c;
+  room->member_count++;
+}
+
+static void server_room_leave(Client *c) {
+  ServerRoom *room = c->room;
+  if (room == NULL) return;
+
+  if (c->room_prev) c->room_prev->room_next = c->room_next;
+  else              room->members = c->room_next;
+  if (c->room_next) c->room_next->room_prev = c->room_prev;
+
+  room->member_count--;
+  room->last_active = event_now_ms();
+  c->room = NULL;
+}
+
+static void server_sweep_rooms(Server *server) {
+  long long now = event_now_ms();
+
+  for (int i = 0; i < SERVER_ROOM_BUCKETS; i++)
+    for (ServerRoom **r = &server->rooms[i]; *r; ) {
+      ServerRoom *room = *r;
+
+      if (server->config.simplify_px > 0)
+        server_room_simplify(server, room);
+      server_room_send_evict(server, room);
+
+      bool idle = room->member_count == 0 &&
+                  room->name[0] != '\0' &&
+                  now - room->last_active > SERVER_ROOM_IDLE_SECS * 1000;
+
+      /* a batch still waiting to go out keeps it around too */
+      for (int j = 0; j < ClientWsFormat_COUNT; j++)
+        if (room->batch[j].payload_len || room->batch[j].frames_len)
+          idle = false;
+
+      /**
+       * With --threads every shard has a copy, and each only knows about
+       * its own members, so they'd each free theirs at a different time.
+       * One made again from a log comes back the same as everyone else's,
+       * but without one it'd be missing everything drawn before, so a
+       * room anyone has drawn in stays.
+       **/
+      if (server->config.shards && !server->config.log_dir &&
+          room->seq_next > 0)
+        idle = false;
+
+      if (!idle) {
+        r = &room->next;
+        continue;
+      }
+
+      *r = room->next;
+      server_room_free(server, room);
+      server->room_count--;
+    }
+}
+
+static void server_client_sync_events(Server *server, Client *c) {
+  event_mod(&server->events, &c->ev, client_events_subscription(c));
 }
 
 static size_t server_client_count(Server *server) {
-  size_t ret = 0;
-  for (Client *c = server->last_client; c; c = c->next)
-    ret++;
-  return ret;
+  return server->client_count;
 }
 
 static void server_add_client(Server *server, int net_fd) {
-  Client *c = calloc(sizeof(Client), 1);
-  client_init(c, net_fd, server->client_id_i++);
+  metrics_add(&metrics_local->accepted, 1);
+
+  /* ids have to be unique across shards too */
+  size_t shard_count = server->config.shards ? server->config.shards->count : 1;
+  Client *c = client_new(
+    net_fd,
+    server->client_id_i++ * shard_count + server->config.shard
+  );
+
+  if (event_add(&server->events, &c->ev, client_events_subscription(c)) < 0) {
+    client_drop(c);
+    client_release(c);
+    return;
+  }
+  server_wheel_schedule(server, c);
+
   c->next = server->last_client;
   server->last_client = c;
+  server->client_count++;
 }
 
 static void server_drop_client(Server *server, Client *c) {
+  server_room_leave(c);
+  server_wheel_remove(server, c);
+  if (c->view_batch) {
+    free(c->view_batch->frames);
+    free(c->view_batch);
+  }
+
+  /* has to happen before client_drop closes the fd */
+  event_del(&server->events, &c->ev);
   client_drop(c);
+  server->client_count--;
 
   if (server->last_client == c) {
     server->last_client = c->next;
@@ -142,100 +881,1194 @@ static void server_drop_client(Server *server, Client *c) {
         break;
       }
 
-  free(c);
+  client_release(c);
 }
 
-static void clientpoint_fprint(ClientPoint *cp, FILE *f) {
-  fprintf(
-    f,
-    "%d, %zu, %zu, %lf, %lf",
-    cp->action,
-    cp->client_id,
-    cp->path_id,
-    cp->x,
-    cp->y
-  );
+/* "action, client_id, path_id, x, y, seq", returns how long it was */
+static size_t clientpoint_sprint(ClientPoint *cp, char *out) {
+  size_t len = 0;
+
+  len += ascii_put_i64(out + len, cp->action);
+  memcpy(out + len, ", ", 2); len += 2;
+  len += ascii_put_u64(out + len, cp->client_id);
+  memcpy(out + len, ", ", 2); len += 2;
+  len += ascii_put_u64(out + len, cp->path_id);
+  memcpy(out + len, ", ", 2); len += 2;
+  len += ascii_put_double(out + len, cp->x);
+  memcpy(out + len, ", ", 2); len += 2;
+  len += ascii_put_double(out + len, cp->y);
+  memcpy(out + len, ", ", 2); len += 2;
+  len += ascii_put_u64(out + len, cp->seq);
+
+  return len;
 }
 
-static int clientpoint_fscan(ClientPoint *cp, FILE *f) {
-  if (fscanf(
-    f,
-    "%zu, %lf, %lf",
-    &cp->path_id,
-    &cp->x,
-    &cp->y
-  ) < 3)
+static bool clientpoint_in_range(ClientPoint *cp) {
+  /* written so NaN fails too */
+  return cp->x >= -CLIENTPOINT_COORD_MAX && cp->x <= CLIENTPOINT_COORD_MAX &&
+         cp->y >= -CLIENTPOINT_COORD_MAX && cp->y <= CLIENTPOINT_COORD_MAX;
+}
+
+/* "path_id, x, y" */
+static int clientpoint_scan(ClientPoint *cp, const char *in, size_t in_len) {
+  const char *p = in, *end = in + in_len;
+  if (!ascii_scan_size(&p, end, &cp->path_id) ||
+      !ascii_expect(&p, end, ",") ||
+      !ascii_scan_double(&p, end, &cp->x) ||
+      !ascii_expect(&p, end, ",") ||
+      !ascii_scan_double(&p, end, &cp->y) ||
+      !clientpoint_in_range(cp))
     return -1;
 
   return 0;
 }
 
-static void server_broadcast_clientpoint(
-  Server *server,
-  ClientPoint *cp
-) {
-  char *msg;
-  size_t msg_len;
+static void clientpoint_put_u32(uint8_t *out, uint32_t v) {
+  out[0] = v >>  0;
+  out[1] = v >>  8;
+  out[2] = v >> 16;
+  out[3] = v >> 24;
+}
+
+static void clientpoint_put_i16(uint8_t *out, double v) {
+  /* clamp so far-off points don't wrap around, then round */
+  if (v < INT16_MIN) v = INT16_MIN;
+  if (v > INT16_MAX) v = INT16_MAX;
+  int16_t q = v < 0 ? v - 0.5 : v + 0.5;
+  out[0] = (uint16_t)q >> 0;
+  out[1] = (uint16_t)q >> 8;
+}
+
+static void clientpoint_pack(ClientPoint *cp, uint8_t *out) {
+  out[0] = cp->action;
+  clientpoint_put_u32(out + 1, cp->client_id);
+  clientpoint_put_u32(out + 5, cp->path_id);
+  clientpoint_put_i16(out + 9, cp->x);
+  clientpoint_put_i16(out + 11, cp->y);
+  clientpoint_put_u32(out + 13, cp->seq);
+}
+
+static int clientpoint_unpack(ClientPoint *cp, uint8_t *in, size_t in_len) {
+  if (in_len != CLIENTPOINT_PACKED_IN_SIZE)
+    return -1;
+
+  cp->path_id = (uint32_t)in[0]       | (uint32_t)in[1] <<  8 |
+                (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+  cp->x = (int16_t)(in[4] | in[5] << 8);
+  cp->y = (int16_t)(in[6] | in[7] << 8);
+  return clientpoint_in_range(cp) ? 0 : -1;
+}
+
+static void server_encode_clientpoint(ClientPoint *cp, ServerEncodedPoint *ep) {
   {
-    FILE *tmp = open_memstream(&msg, &msg_len);
+    ep->payload[ClientWsFormat_Text] = ep->text;
+    ep->payload_len[ClientWsFormat_Text] = clientpoint_sprint(cp, ep->text);
+  }
 
-    clientpoint_fprint(cp, tmp);
+  {
+    ep->payload[ClientWsFormat_Binary] = (char *)ep->binary;
+    ep->payload_len[ClientWsFormat_Binary] = CLIENTPOINT_PACKED_SIZE;
+    clientpoint_pack(cp, ep->binary);
+  }
+}
 
-    fclose(tmp);
+static void server_batch_close_frame(ServerBatch *b, ClientWsFormat format) {
+  if (b->payload_len == 0) return;
+
+  char *payload = b->payload;
+  size_t payload_len = b->payload_len;
+
+  /* only worth sending compressed if it came out smaller */
+  char deflated[CLIENT_WS_PAYLOAD_MAX];
+  if (b->deflate) {
+    size_t deflated_len = client_ws_deflate(
+      b->payload,
+      b->payload_len,
+      deflated,
+      sizeof(deflated)
+    );
+    if (deflated_len > 0 && deflated_len < payload_len) {
+      payload = deflated;
+      payload_len = deflated_len;
+    }
+  }
+
+  size_t needed = b->frames_len + CLIENT_WS_HEADER_MAX + payload_len;
+  if (needed > b->frames_cap) {
+    b->frames_cap = b->frames_cap ? b->frames_cap : 1024;
+    while (b->frames_cap < needed) b->frames_cap *= 2;
+    b->frames = realloc(b->frames, b->frames_cap);
+  }
+
+  b->frames_len += client_ws_header(
+    (uint8_t *)b->frames + b->frames_len,
+    client_ws_format_opcode(format),
+    payload != b->payload,
+    payload_len
+  );
+  memcpy(b->frames + b->frames_len, payload, payload_len);
+  b->frames_len += payload_len;
+  b->payload_len = 0;
+}
+
+static void server_batch_push(
+  ServerBatch *b,
+  ClientWsFormat format,
+  char *record,
+  size_t record_len
+) {
+  /* text records go one per line */
+  size_t sep = (format == ClientWsFormat_Text && b->payload_len > 0);
+
+  if (b->payload_len + sep + record_len > CLIENT_WS_PAYLOAD_MAX) {
+    server_batch_close_frame(b, format);
+    sep = 0;
   }
 
+  /* one record that doesn't fit in a frame on its own */
+  if (record_len > CLIENT_WS_PAYLOAD_MAX) return;
+
+  if (sep) b->payload[b->payload_len++] = '\n';
+  memcpy(b->payload + b->payload_len, record, record_len);
+  b->payload_len += record_len;
+}
+
+/**
+ * `cell` is where the point in the frames is, so members that can't see
+ * it can be skipped. -1 is for a room batch, which only goes to members
+ * who see everything.
+ **/
+static void server_broadcast_frames(
+  Server *server,
+  ServerRoom *room,
+  ClientFrame *frames[ClientWsFormat_COUNT],
+  int cell
+) {
+  /* framed once, every peer just holds a reference to it */
   for (
-    Client *other = server->last_client;
+    Client *other = room->members;
     other;
-    other = other->next
+    other = other->room_next
   ) {
     if (other->phase != ClientPhase_Websocket) continue;
+    if (cell == -1 ? other->ws_view.set : !server_client_sees(other, cell))
+      continue;
+
+    client_ws_send_broadcast(other, frames[other->ws_format]);
+    server_client_sync_events(server, other);
+  }
+}
+
+static void server_broadcast_encoded(
+  Server *server,
+  ServerRoom *room,
+  ServerEncodedPoint *ep,
+  int cell
+) {
+  metrics_add(&metrics_local->points_broadcast, 1);
+
+  /* hang on to it, it'll go out with everything else in the batch */
+  if (server->config.coalesce_ms >= 0) {
+    if (server->ingest_us) {
+      if (room->batch_ingest_count == room->batch_ingest_cap) {
+        room->batch_ingest_cap = room->batch_ingest_cap
+          ? room->batch_ingest_cap * 2
+          : 64;
+        room->batch_ingest_us = reallocarray(
+          room->batch_ingest_us,
+          room->batch_ingest_cap,
+          sizeof(long long)
+        );
+      }
+      room->batch_ingest_us[room->batch_ingest_count++] = server->ingest_us;
+    }
+
+    for (int i = 0; i < ClientWsFormat_COUNT; i++)
+      server_batch_push(
+        &room->batch[i],
+        i,
+        ep->payload[i],
+        ep->payload_len[i]
+      );
+
+    /* the ones with a view get a batch of only what they can see */
+    for (Client *c = room->members; c; c = c->room_next) {
+      if (!c->ws_view.set || !server_client_sees(c, cell)) continue;
+
+      if (c->view_batch == NULL)
+        c->view_batch = calloc(sizeof(ServerBatch), 1);
+      server_batch_push(
+        c->view_batch,
+        c->ws_format,
+        ep->payload[c->ws_format],
+        ep->payload_len[c->ws_format]
+      );
+    }
+
+    if (server->batch_deadline == 0)
+      server->batch_deadline = event_now_ms() + server->config.coalesce_ms;
+    return;
+  }
 
-    client_ws_send_text(other, msg, msg_len);
+  ClientFrame *frames[ClientWsFormat_COUNT];
+  for (int i = 0; i < ClientWsFormat_COUNT; i++)
+    frames[i] = client_ws_frame(
+      client_ws_format_opcode(i),
+      ep->payload[i],
+      ep->payload_len[i]
+    );
+
+  server_broadcast_frames(server, room, frames, cell);
+  if (server->ingest_us) {
+    if (server->fanout_count == server->fanout_cap) {
+      server->fanout_cap = server->fanout_cap ? server->fanout_cap * 2 : 64;
+      server->fanout_us = reallocarray(
+        server->fanout_us,
+        server->fanout_cap,
+        sizeof(long long)
+      );
+    }
+    server->fanout_us[server->fanout_count++] = server->ingest_us;
   }
 
-  free(msg);
+  for (int i = 0; i < ClientWsFormat_COUNT; i++)
+    client_frame_unref(frames[i]);
 }
 
-static int server_ws_handle_request(Server *server, Client *c) {
+static void server_broadcast_clientpoint(
+  Server *server,
+  ServerRoom *room,
+  ClientPoint *cp,
+  int cell
+) {
+  ServerEncodedPoint ep;
+  server_encode_clientpoint(cp, &ep);
+  server_broadcast_encoded(server, room, &ep, cell);
+}
 
-  if (c->ws_req.opcode != 1)
-    return 0;
+static void server_flush_batch(Server *server) {
+  /* points that went straight out this time around: one clock read
+   * covers all of them */
+  if (server->fanout_count) {
+    long long now_us = metrics_now_us();
+    for (size_t i = 0; i < server->fanout_count; i++)
+      metrics_observe(&metrics_local->fanout, now_us - server->fanout_us[i]);
+    server->fanout_count = 0;
+  }
 
-  ClientPoint cp = { .action = ClientPointAction_Add, .client_id = c->id };
-  {
-    FILE *req = fmemopen(c->ws_req.payload, c->ws_req.payload_len, "r");
-    if (clientpoint_fscan(&cp, req) < 0) {
-      fclose(req);
+  if (server->batch_deadline == 0) return;
+  if (event_now_ms() < server->batch_deadline) return;
+  server->batch_deadline = 0;
+
+  for (int r = 0; r < SERVER_ROOM_BUCKETS; r++)
+    for (ServerRoom *room = server->rooms[r]; room; room = room->next) {
+
+      for (Client *c = room->members; c; c = c->room_next) {
+        ServerBatch *b = c->view_batch;
+        if (b == NULL || (b->payload_len == 0 && b->frames_len == 0))
+          continue;
+
+        server_batch_close_frame(b, c->ws_format);
+        ClientFrame *f = client_frame_new(b->frames_len);
+        memcpy(f->data, b->frames, b->frames_len);
+        b->frames_len = 0;
+
+        client_ws_send_broadcast(c, f);
+        client_frame_unref(f);
+        server_client_sync_events(server, c);
+      }
+
+      /* every format gets every point, so one's as good as another */
+      if (room->batch[0].payload_len == 0 && room->batch[0].frames_len == 0)
+        continue;
+
+      ClientFrame *frames[ClientWsFormat_COUNT];
+      for (int i = 0; i < ClientWsFormat_COUNT; i++) {
+        ServerBatch *b = &room->batch[i];
+        server_batch_close_frame(b, i);
+
+        frames[i] = client_frame_new(b->frames_len);
+        memcpy(frames[i]->data, b->frames, b->frames_len);
+        b->frames_len = 0;
+      }
+
+      server_broadcast_frames(server, room, frames, -1);
+
+      for (int i = 0; i < ClientWsFormat_COUNT; i++)
+        client_frame_unref(frames[i]);
+
+      long long now_us = room->batch_ingest_count ? metrics_now_us() : 0;
+      for (size_t i = 0; i < room->batch_ingest_count; i++)
+        metrics_observe(
+          &metrics_local->fanout,
+          now_us - room->batch_ingest_us[i]
+        );
+      room->batch_ingest_count = 0;
+    }
+}
+
+static void server_history_changed(ServerHistory *h) {
+  for (int i = 0; i < 2; i++)
+    if (h->frame[i]) {
+      client_frame_unref(h->frame[i]);
+      h->frame[i] = NULL;
+    }
+}
+
+/* the oldest point is going away, which is always the one at the front */
+static void server_history_pop(ServerHistory *h, size_t record_len) {
+  h->start += record_len;
+  server_history_changed(h);
+}
+
+/* returns how long the record it added was, and where it went in `at` */
+static size_t server_history_push(
+  ServerHistory *h,
+  ClientWsFormat format,
+  char *payload,
+  size_t payload_len,
+  uint64_t *at
+) {
+  size_t record_len = payload_len + (format == ClientWsFormat_Text);
+
+  if (h->end + record_len > h->cap) {
+    /* slide everything down first, if that frees up enough room */
+    if (h->start > 0) {
+      memmove(h->buf, h->buf + h->start, h->end - h->start);
+      h->end -= h->start;
+      h->base += h->start;
+      h->start = 0;
+    }
+
+    if (h->end + record_len > h->cap) {
+      h->cap = h->cap ? h->cap * 2 : (1 << 16);
+      while (h->end + record_len > h->cap) h->cap *= 2;
+      h->buf = realloc(h->buf, h->cap);
+    }
+  }
+
+  *at = h->base + h->end;
+  memcpy(h->buf + h->end, payload, payload_len);
+  if (format == ClientWsFormat_Text) h->buf[h->end + payload_len] = '\n';
+
+  h->end += record_len;
+  server_history_changed(h);
+  return record_len;
+}
+
+/**
+ * Blanks out a record that's somewhere in the middle, by making it a
+ * ClientPointAction_None. The action comes first in both formats.
+ **/
+static void server_history_kill(
+  ServerHistory *h,
+  ClientWsFormat format,
+  uint64_t at
+) {
+  char *record = h->buf + (at - h->base);
+  *record = format == ClientWsFormat_Text ? '0' : ClientPointAction_None;
+  server_history_changed(h);
+}
+
+/* all of the history in one buffer, shared by everyone who joins */
+static ClientFrame *server_history_frame(
+  ServerHistory *h,
+  ClientWsFormat format,
+  bool deflate
+) {
+  if (h->frame[deflate] == NULL) {
+    /* the same packing a coalesced broadcast gets */
+    ServerBatch b = { .deflate = deflate };
+
+    char *p = h->buf + h->start, *end = h->buf + h->end;
+    while (p < end) {
+      size_t len = CLIENTPOINT_PACKED_SIZE;
+      if (format == ClientWsFormat_Text)
+        len = (char *)memchr(p, '\n', end - p) - p;
+
+      /* killed ones just take up space until the ring's compacted */
+      bool dead = format == ClientWsFormat_Text
+        ? *p == '0'
+        : *p == ClientPointAction_None;
+      if (!dead) server_batch_push(&b, format, p, len);
+      p += len + (format == ClientWsFormat_Text);
+    }
+    server_batch_close_frame(&b, format);
+
+    /* an empty room never got any frames allocated */
+    h->frame[deflate] = client_frame_new(b.frames_len);
+    if (b.frames_len) memcpy(h->frame[deflate]->data, b.frames, b.frames_len);
+    free(b.frames);
+  }
+
+  return h->frame[deflate];
+}
+
+/* adds a chunk to the ring, if it's allowed to get any bigger */
+static bool server_room_grow(Server *server, ServerRoom *room) {
+  ServerConfig *config = &server->config;
+  if (room->points_full || room->points_cap >= config->history_points)
+    return false;
+
+  bool logged = room->log.header != NULL;
+  size_t size = sizeof(ServerChunk);
+  if (!logged) size += sizeof(ClientPoint) * SERVER_CHUNK_POINTS;
+
+  /* everyone gets one, or they couldn't hold anything at all */
+  if (!logged && config->history_budget && room->chunk_count > 0 &&
+      server->chunk_bytes + size > config->history_budget)
+    return false;
+
+  ServerChunk *ch = calloc(1, size);
+  ch->points = logged ? room->log.points + room->points_cap : ch->own;
+
+  room->chunks = reallocarray(
+    room->chunks,
+    room->chunk_count + 1,
+    sizeof(ServerChunk *)
+  );
+  room->chunks[room->chunk_count++] = ch;
+  room->chunk_bytes += size;
+  server->chunk_bytes += size;
+
+  room->points_cap += SERVER_CHUNK_POINTS;
+  if (room->points_cap > config->history_points)
+    room->points_cap = config->history_points;
+  return true;
+}
+
+/* files away a point that's already in its slot, in the grid and the history */
+static void server_room_index(
+  ServerRoom *room,
+  size_t slot,
+  ServerEncodedPoint *ep,
+  int cell
+) {
+  ServerChunk *ch = server_room_chunk(room, slot);
+  size_t i = SERVER_CHUNK_I(slot);
+
+  server_grid_insert(room, slot, cell);
+  for (int f = 0; f < ClientWsFormat_COUNT; f++)
+    ch->history_len[f][i] = server_history_push(
+      &room->history[f],
+      f,
+      ep->payload[f],
+      ep->payload_len[f],
+      &ch->history_at[f][i]
+    );
+}
+
+/**
+ * Puts a point in the next slot of the ring, pushing out whatever was
+ * there. Everyone in the room hears about both, unless it's `quiet`ly
+ * being filled back in from before a restart.
+ **/
+static void server_room_store(
+  Server *server,
+  ServerRoom *room,
+  ClientPoint *cp,
+  bool quiet
+) {
+  size_t slot = room->points_i;
+  ServerChunk *ch = server_room_chunk(room, slot);
+  size_t i = SERVER_CHUNK_I(slot);
+  ClientPoint *sp = &ch->points[i];
+
+  /* there's already an active point at this location in the ring
+   * buffer; the next Evict takes care of telling everyone */
+  if (sp->action == ClientPointAction_Add) {
+    metrics_add(&metrics_local->points_evicted, 1);
+    room->evict_seq = sp->seq + 1;
+    server_grid_remove(room, slot);
+  } else if (ch->history_len[0][i]) {
+    /* one server_room_drop emptied out, that we got to before compacting */
+    room->dropped--;
+  }
+  for (int f = 0; f < ClientWsFormat_COUNT; f++)
+    if (ch->history_len[f][i])
+      server_history_pop(&room->history[f], ch->history_len[f][i]);
+
+  /* points coming back from a log already have theirs */
+  if (quiet) {
+    if (cp->seq >= room->seq_next) room->seq_next = cp->seq + 1;
+  } else
+    cp->seq = room->seq_next++;
+
+  *sp = *cp;
+  int cell = server_grid_cell(cp);
+
+  ServerEncodedPoint ep;
+  server_encode_clientpoint(cp, &ep);
+  server_room_index(room, slot, &ep, cell);
+  if (!quiet) server_broadcast_encoded(server, room, &ep, cell);
+
+  server_log_append(&room->log);
+
+  if (++room->points_i == room->points_cap && !server_room_grow(server, room)) {
+    room->points_i = 0;
+    room->points_full = true;
+  }
+}
+
+static ServerPath *server_room_path(
+  ServerRoom *room,
+  ClientPoint *cp,
+  bool create
+) {
+  for (size_t i = 0; i < room->path_count; i++)
+    if (room->paths[i].client_id == cp->client_id &&
+        room->paths[i].path_id == cp->path_id)
+      return &room->paths[i];
+
+  if (!create) return NULL;
+
+  if (room->path_count == room->path_cap) {
+    room->path_cap = room->path_cap ? room->path_cap * 2 : 8;
+    room->paths = reallocarray(room->paths, room->path_cap, sizeof(ServerPath));
+  }
+  ServerPath *path = &room->paths[room->path_count++];
+  *path = (ServerPath) { .client_id = cp->client_id, .path_id = cp->path_id };
+  return path;
+}
+
+static void server_path_push(ServerPath *path, size_t slot) {
+  if (path->slot_count == path->slot_cap) {
+    path->slot_cap = path->slot_cap ? path->slot_cap * 2 : 64;
+    path->slots = reallocarray(path->slots, path->slot_cap, sizeof(size_t));
+  }
+  path->slots[path->slot_count++] = slot;
+}
+
+/**
+ * Takes a point out of the middle of the ring: everyone who can see it
+ * is told to remove it, and its slot and history records are blanked
+ * out. They only get reused once the ring is compacted.
+ **/
+static void server_room_drop(Server *server, ServerRoom *room, size_t slot) {
+  ServerChunk *ch = server_room_chunk(room, slot);
+  size_t i = SERVER_CHUNK_I(slot);
+  ClientPoint *sp = &ch->points[i];
+
+  sp->action = ClientPointAction_Remove;
+  server_broadcast_clientpoint(server, room, sp, ch->grid_cell[i]);
+  sp->action = ClientPointAction_None;
+
+  for (int f = 0; f < ClientWsFormat_COUNT; f++)
+    server_history_kill(&room->history[f], f, ch->history_at[f][i]);
+  server_grid_remove(room, slot);
+  room->dropped++;
+}
+
+/* how far p is from the segment a-b, squared */
+static double server_segment_dist2(
+  ClientPoint *p,
+  ClientPoint *a,
+  ClientPoint *b
+) {
+  double dx = b->x - a->x, dy = b->y - a->y;
+  double len2 = dx * dx + dy * dy;
+
+  /* the closest spot on the segment, as a fraction of the way along it */
+  double t = len2 > 0 ? ((p->x - a->x) * dx + (p->y - a->y) * dy) / len2 : 0;
+  if (t < 0) t = 0;
+  if (t > 1) t = 1;
+
+  double ex = a->x + t * dx - p->x, ey = a->y + t * dy - p->y;
+  return ex * ex + ey * ey;
+}
+
+/**
+ * Ramer-Douglas-Peucker: both ends stay, and so does whichever point in
+ * between is furthest from the segment joining them, if it's more than
+ * `tolerance` off of it; then the same again on either side of that
+ * one. Everything else in `keep` comes back false.
+ **/
+static void server_points_simplify(
+  ClientPoint **pts,
+  size_t count,
+  double tolerance,
+  bool *keep
+) {
+  memset(keep, 0, count);
+  keep[0] = keep[count - 1] = true;
+
+  /* spans left to look at, instead of recursing */
+  size_t (*spans)[2] = malloc(sizeof(*spans) * count);
+  size_t span_count = 0;
+  spans[span_count][0] = 0;
+  spans[span_count][1] = count - 1;
+  span_count++;
+
+  while (span_count) {
+    span_count--;
+    size_t a = spans[span_count][0], b = spans[span_count][1];
+
+    size_t furthest = 0;
+    double furthest_d2 = tolerance * tolerance;
+    for (size_t i = a + 1; i < b; i++) {
+      double d2 = server_segment_dist2(pts[i], pts[a], pts[b]);
+      if (d2 > furthest_d2) furthest = i, furthest_d2 = d2;
+    }
+    if (furthest == 0) continue;
+
+    keep[furthest] = true;
+    spans[span_count][0] = a;
+    spans[span_count][1] = furthest;
+    span_count++;
+    spans[span_count][0] = furthest;
+    spans[span_count][1] = b;
+    span_count++;
+  }
+
+  free(spans);
+}
+
+static void server_room_simplify_path(
+  Server *server,
+  ServerRoom *room,
+  ServerPath *path
+) {
+  /* only the points that haven't been pushed out of the ring since */
+  ClientPoint **pts = malloc(sizeof(ClientPoint *) * path->slot_count);
+  size_t count = 0;
+  for (size_t i = 0; i < path->slot_count; i++) {
+    ClientPoint *cp = server_room_point(room, path->slots[i]);
+    if (cp->action != ClientPointAction_Add ||
+        cp->client_id != path->client_id ||
+        cp->path_id != path->path_id)
+      continue;
+
+    path->slots[count] = path->slots[i];
+    pts[count++] = cp;
+  }
+
+  if (count > 2) {
+    bool *keep = malloc(count);
+    server_points_simplify(pts, count, server->config.simplify_px, keep);
+    for (size_t i = 0; i < count; i++)
+      if (!keep[i]) server_room_drop(server, room, path->slots[i]);
+    free(keep);
+  }
+
+  free(pts);
+}
+
+/**
+ * Slides every point left in the ring down over the dropped ones, so
+ * the oldest is in slot 0 and the free slots are all at the end, and
+ * rebuilds everything that refers to slots. Everyone already has
+ * these points, so nobody needs to hear about it.
+ *
+ * A logged room's ring is its log, so while the slots are being
+ * rewritten the log's seq says it's empty: a crash partway through
+ * comes back to an empty room instead of a mix of old and new slots.
+ * The points are gathered up to the side first so that window is
+ * just the copy back.
+ **/
+static void server_room_compact(ServerRoom *room) {
+  size_t cap = room->points_cap;
+
+  ClientPoint *points = malloc(sizeof(ClientPoint) * cap);
+  if (points == NULL) return;
+
+  /* oldest first is points_i .. cap, then 0 .. points_i */
+  size_t oldest = room->points_full ? room->points_i : 0;
+  size_t kept = 0;
+  for (size_t i = 0; i < cap; i++) {
+    ClientPoint *cp = server_room_point(room, (oldest + i) % cap);
+    if (cp->action == ClientPointAction_Add) points[kept++] = *cp;
+  }
+
+  /* seq_cst, so none of the slot writes below get moved ahead of it */
+  if (room->log.header) atomic_store(&room->log.header->seq, 0);
+
+  for (size_t slot = 0; slot < kept; slot++)
+    *server_room_point(room, slot) = points[slot];
+  free(points);
+
+  for (size_t slot = kept; slot < cap; slot++) {
+    ServerChunk *ch = server_room_chunk(room, slot);
+    size_t i = SERVER_CHUNK_I(slot);
+    ch->points[i].action = ClientPointAction_None;
+    for (int f = 0; f < ClientWsFormat_COUNT; f++) ch->history_len[f][i] = 0;
+  }
+
+  memset(room->grid.head, -1, sizeof(room->grid.head));
+  for (int f = 0; f < ClientWsFormat_COUNT; f++) {
+    ServerHistory *h = &room->history[f];
+    h->base += h->end;
+    h->start = h->end = 0;
+    server_history_changed(h);
+  }
+  for (size_t i = 0; i < room->path_count; i++)
+    room->paths[i].slot_count = 0;
+
+  for (size_t slot = 0; slot < kept; slot++) {
+    ClientPoint *cp = server_room_point(room, slot);
+
+    ServerEncodedPoint ep;
+    server_encode_clientpoint(cp, &ep);
+    server_room_index(room, slot, &ep, server_grid_cell(cp));
+
+    /* the ones still being drawn have to know where their points went */
+    ServerPath *path = server_room_path(room, cp, false);
+    if (path) server_path_push(path, slot);
+  }
+
+  room->points_i = kept % cap;
+  room->points_full = kept == cap;
+  room->dropped = 0;
+  if (room->log.header)
+    atomic_store_explicit(&room->log.header->seq, kept, memory_order_release);
+}
+
+/**
+ * Paths that haven't had a new point in SERVER_PATH_IDLE_MS are done,
+ * so any of their points that don't change what they look like by
+ * more than config.simplify_px can go. Once enough slots have been
+ * emptied out that way, the ring gets compacted so they hold new
+ * points again.
+ **/
+static void server_room_simplify(Server *server, ServerRoom *room) {
+  long long now = event_now_ms();
+
+  for (size_t i = 0; i < room->path_count; ) {
+    ServerPath *path = &room->paths[i];
+    if (now - path->last_ms < SERVER_PATH_IDLE_MS) {
+      i++;
+      continue;
+    }
+
+    /* any longer, and it might have been given the same slot twice */
+    if (path->slot_count <= room->points_cap)
+      server_room_simplify_path(server, room, path);
+
+    free(path->slots);
+    room->paths[i] = room->paths[--room->path_count];
+  }
+
+  if (room->dropped > 0 && room->dropped * 4 >= room->points_cap)
+    server_room_compact(room);
+}
+
+/* lets the room know about everything pushed out of the ring since last time */
+static void server_room_send_evict(Server *server, ServerRoom *room) {
+  if (room->evict_seq == room->evict_sent) return;
+
+  ClientPoint cp = {
+    .action = ClientPointAction_Evict,
+    .seq = room->evict_seq,
+  };
+  server_broadcast_clientpoint(server, room, &cp, SERVER_CELL_ANY);
+  room->evict_sent = room->evict_seq;
+}
+
+/**
+ * A new point, from one of our clients or another shard, that came in
+ * at `ingest_us` (event_now_us() time).
+ **/
+static void server_ingest_point(
+  Server *server,
+  ServerRoom *room,
+  ClientPoint *cp,
+  long long ingest_us
+) {
+  size_t slot = room->points_i;
+  server->ingest_us = ingest_us;
+  server_room_store(server, room, cp, false);
+  server->ingest_us = 0;
+
+  if (server->config.simplify_px > 0) {
+    ServerPath *path = server_room_path(room, cp, true);
+    server_path_push(path, slot);
+    path->last_ms = event_now_ms();
+  }
+
+  if (server->ids_log && cp->client_id >= server->ids_log->client_id_next)
+    server->ids_log->client_id_next = cp->client_id + 1;
+
+  room->last_active = event_now_ms();
+}
+
+/**
+ * Gives a new room its first chunk, or fills it in from its log if
+ * there's one, and rebuilds everything we keep about those points.
+ **/
+static void server_room_load(Server *server, ServerRoom *room) {
+  ServerConfig *config = &server->config;
+  size_t count = config->history_points;
+  bool writer = config->shard == 0;
+  uint32_t client_id_next = 0;
+
+  char path[4096];
+  if (config->log_dir)
+    snprintf(
+      path,
+      sizeof(path),
+      "%s/room%s%s.log",
+      config->log_dir,
+      room->name[0] ? "-" : "",
+      room->name
+    );
+
+  if (config->log_dir && writer && server_log_open(&room->log, path, count)) {
+    client_id_next = room->log.header->client_id_next;
+
+    /* the points are already where they go, the ring just has to catch up */
+    uint64_t seq = room->log.header->seq;
+    room->points_i = seq % count;
+    size_t want = seq >= count ? count : room->points_i + 1;
+    while (room->points_cap < want) server_room_grow(server, room);
+    room->points_full = seq >= count;
+
+    /* oldest first, the same as they came in */
+    for (size_t i = 0; i < room->points_cap; i++) {
+      size_t slot = (room->points_i + i) % room->points_cap;
+      ClientPoint *cp = server_room_point(room, slot);
+      if (cp->action != ClientPointAction_Add) continue;
+      room->seq_next = cp->seq + 1;
+
+      ServerEncodedPoint ep;
+      server_encode_clientpoint(cp, &ep);
+      server_room_index(room, slot, &ep, server_grid_cell(cp));
+    }
+  } else {
+    server_room_grow(server, room);
+
+    /* it's somebody else's to write, we just keep a copy */
+    if (config->log_dir && !writer) {
+      ClientPoint *points = calloc(count, sizeof(ClientPoint));
+      size_t points_i;
+      if (server_log_read(path, count, points, &points_i, &client_id_next))
+        for (size_t i = 0; i < count; i++) {
+          ClientPoint *cp = &points[(points_i + i) % count];
+          if (cp->action == ClientPointAction_Add)
+            server_room_store(server, room, cp, true);
+        }
+      free(points);
+    }
+  }
+
+  if (room->name[0] == '\0') {
+    if (room->log.header) server->ids_log = room->log.header;
+
+    /* ids are handed out as client_id_i * shard count + shard */
+    size_t shard_count = config->shards ? config->shards->count : 1;
+    size_t next = (client_id_next + shard_count - 1) / shard_count;
+    if (server->client_id_i < next) server->client_id_i = next;
+  }
+}
+
+static int server_shards_init(ServerShards *shards, size_t count) {
+  *shards = (ServerShards) {
+    .count = count,
+    .shards = calloc(count, sizeof(ServerShard)),
+  };
+
+  for (size_t i = 0; i < count; i++) {
+    ServerShard *shard = &shards->shards[i];
+    shard->inbox = aligned_alloc(64, count * sizeof(ServerShardQueue));
+    for (size_t j = 0; j < count; j++) {
+      atomic_init(&shard->inbox[j].head, 0);
+      atomic_init(&shard->inbox[j].tail, 0);
+    }
+    atomic_init(&shard->wake_pending, false);
+
+    /* a socket rather than a pipe, because io_uring only recv()s sockets */
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, shard->wake_fds) < 0) {
+      perror("socketpair()");
+      shard->wake_fds[0] = shard->wake_fds[1] = -1;
       return -1;
     }
-    fclose(req);
+    for (int j = 0; j < 2; j++)
+      fcntl(
+        shard->wake_fds[j],
+        F_SETFL,
+        fcntl(shard->wake_fds[j], F_GETFL, 0) | O_NONBLOCK
+      );
   }
 
-  {
-    ClientPoint *sp = &server->points[server->points_i];
+  return 0;
+}
+
+static void server_shards_free(ServerShards *shards) {
+  for (size_t i = 0; i < shards->count; i++) {
+    ServerShard *shard = &shards->shards[i];
+    if (shard->inbox == NULL) continue;
+    free(shard->inbox);
+    if (shard->wake_fds[0] >= 0) close(shard->wake_fds[0]);
+    if (shard->wake_fds[1] >= 0) close(shard->wake_fds[1]);
+  }
+  free(shards->shards);
+  *shards = (ServerShards) {0};
+}
 
-    /* broadcast a remove event if there's already an
-     * active point at this location in the ring buffer */
-    if (sp->action == ClientPointAction_Add) {
-      sp->action = ClientPointAction_Remove;
-      server_broadcast_clientpoint(server, sp);
+/* passes a point one of our clients sent on to every other shard */
+static void server_shard_forward(
+  Server *server,
+  ServerRoom *room,
+  ClientPoint *cp,
+  long long ingest_us
+) {
+  ServerShards *shards = server->config.shards;
+  if (shards == NULL) return;
+
+  for (size_t i = 0; i < shards->count; i++) {
+    if (i == server->config.shard) continue;
+    ServerShard *to = &shards->shards[i];
+    ServerShardQueue *q = &to->inbox[server->config.shard];
+
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head == SERVER_SHARD_QUEUE_SIZE) {
+      fprintf(
+        stderr,
+        "shard %zu isn't keeping up, dropping a point for it\n",
+        i
+      );
+      continue;
     }
 
-    *sp = cp;
-    server->points_i = (server->points_i + 1) % POINT_COUNT;
+    ServerShardMsg *msg = &q->msgs[tail % SERVER_SHARD_QUEUE_SIZE];
+    strcpy(msg->room, room->name);
+    msg->cp = *cp;
+    msg->ingest_us = ingest_us;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+    if (!atomic_exchange(&to->wake_pending, true))
+      send(to->wake_fds[1], "", 1, 0);
+  }
+}
+
+static void server_shard_drain(Server *server) {
+  ServerShards *shards = server->config.shards;
+  ServerShard *me = &shards->shards[server->config.shard];
+
+  /* eat the wakeups, there's at most a couple of these */
+  char buf[64];
+  while (event_recv(&server->wake_ev, buf, sizeof(buf)) > 0);
+
+  /* anything pushed after this point wakes us up again */
+  atomic_store(&me->wake_pending, false);
+
+  for (size_t i = 0; i < shards->count; i++) {
+    if (i == server->config.shard) continue;
+    ServerShardQueue *q = &me->inbox[i];
+
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    for (; head != tail; head++) {
+      ServerShardMsg *msg = &q->msgs[head % SERVER_SHARD_QUEUE_SIZE];
+      ServerRoom *room = server_room_find(server, msg->room, true);
+      server_ingest_point(server, room, &msg->cp, msg->ingest_us);
+    }
+    atomic_store_explicit(&q->head, head, memory_order_release);
+  }
+}
+
+static int server_size_cmp(const void *a, const void *b) {
+  size_t x = *(const size_t *)a, y = *(const size_t *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Sends a client the points in its room that are in the cells of its
+ * view, oldest first, leaving out the cells that were already in `old`
+ * (NULL if they're all new). Not shared like the history snapshot,
+ * because everybody's view is different.
+ **/
+static void server_room_send_view(
+  Server *server,
+  ServerRoom *room,
+  Client *c,
+  ServerView *old
+) {
+  ServerView view;
+  if (!server_client_view(c, &view)) return;
+
+  /**
+   * The grid tells us which slots, and how far each one is past
+   * points_i tells us how old it is; sorting on that puts them back
+   * in the order they were drawn in.
+   **/
+  size_t *ages = NULL, age_count = 0, age_cap = 0;
+  for (int y = view.y0; y <= view.y1; y++)
+    for (int x = view.x0; x <= view.x1; x++) {
+      int cell = y * SERVER_GRID_SIZE + x;
+      if (old && server_view_has(old, cell)) continue;
+
+      for (int32_t s = room->grid.head[cell]; s >= 0;
+           s = *server_grid_next(room, s)) {
+        if (age_count == age_cap) {
+          age_cap = age_cap ? age_cap * 2 : 256;
+          ages = reallocarray(ages, age_cap, sizeof(size_t));
+        }
+        ages[age_count++] =
+          (s + room->points_cap - room->points_i) % room->points_cap;
+      }
+    }
+  if (age_count == 0) return;
+  qsort(ages, age_count, sizeof(size_t), server_size_cmp);
+
+  ServerBatch b = { .deflate = c->ws_deflate };
+  for (size_t i = 0; i < age_count; i++) {
+    size_t slot = (room->points_i + ages[i]) % room->points_cap;
+
+    ServerEncodedPoint ep;
+    server_encode_clientpoint(server_room_point(room, slot), &ep);
+    server_batch_push(
+      &b,
+      c->ws_format,
+      ep.payload[c->ws_format],
+      ep.payload_len[c->ws_format]
+    );
   }
+  server_batch_close_frame(&b, c->ws_format);
+  free(ages);
 
-  server_broadcast_clientpoint(server, &cp);
+  ClientFrame *f = client_frame_new(b.frames_len);
+  memcpy(f->data, b.frames, b.frames_len);
+  free(b.frames);
 
+  client_ws_send_frame(c, f);
+  client_frame_unref(f);
+  server_client_sync_events(server, c);
+}
+
+/* "view x0, y0, x1, y1": they've moved, send whatever came into view */
+static int server_ws_handle_view(
+  Server *server,
+  Client *c,
+  const char *req,
+  size_t req_len
+) {
+  const char *p = req, *end = req + req_len;
+  int x0, y0, x1, y1;
+  if (!ascii_expect(&p, end, "view") ||
+      !ascii_scan_int(&p, end, &x0) || !ascii_expect(&p, end, ",") ||
+      !ascii_scan_int(&p, end, &y0) || !ascii_expect(&p, end, ",") ||
+      !ascii_scan_int(&p, end, &x1) || !ascii_expect(&p, end, ",") ||
+      !ascii_scan_int(&p, end, &y1))
+    return -1;
+
+  /* if they saw everything before, there's nothing new to send */
+  ServerView old;
+  bool had_view = server_client_view(c, &old);
+
+  c->ws_view.set = true;
+  c->ws_view.x0 = x0;
+  c->ws_view.y0 = y0;
+  c->ws_view.x1 = x1;
+  c->ws_view.y1 = y1;
+
+  if (had_view) server_room_send_view(server, c->room, c, &old);
   return 0;
 }
 
+static int server_ws_handle_request(Server *server, Client *c) {
+
+  ClientPoint cp = { .action = ClientPointAction_Add, .client_id = c->id };
+
+  switch (c->ws_req.opcode) {
+
+    /* text */
+    case 1: {
+      char *req = c->ws_req.payload;
+      size_t req_len = c->ws_req.payload_len;
+
+      /* everything else is a point */
+      if (req_len >= 5 && memcmp(req, "view ", 5) == 0)
+        return server_ws_handle_view(server, c, req, req_len);
+
+      if (clientpoint_scan(&cp, req, req_len) < 0)
+        return -1;
+    } break;
+
+    /* binary */
+    case 2: {
+      if (clientpoint_unpack(
+        &cp,
+        (uint8_t *)c->ws_req.payload,
+        c->ws_req.payload_len
+      ) < 0)
+        return -1;
+    } break;
+
+    default: return 0;
+  }
+
+  long long ingest_us = event_now_us();
+  metrics_add(&metrics_local->points_ingested, 1);
+  server_ingest_point(server, c->room, &cp, ingest_us);
+  server_shard_forward(server, c->room, &cp, ingest_us);
+
+  return 0;
+}
+
+/* what a client gets when they show up: the room as it is right now */
+static void server_client_send_snapshot(Server *server, Client *c) {
+  if (c->ws_view.set) {
+    server_room_send_view(server, c->room, c, NULL);
+    return;
+  }
+
+  ClientFrame *history = server_history_frame(
+    &c->room->history[c->ws_format],
+    c->ws_format,
+    c->ws_deflate
+  );
+  if (history->len > 0)
+    client_ws_send_frame(c, history);
+}
+
+/**
+ * They fell so far behind that the points we had queued for them got
+ * thrown out, so what they have has holes in it. Now that they've
+ * caught up, wipe it and start them over.
+ **/
+static void server_client_resync(Server *server, Client *c) {
+  c->ws_resync = false;
+
+  /* everything they have is older than seq_next, so this evicts all of it */
+  ClientPoint cp = {
+    .action = ClientPointAction_Evict,
+    .seq = c->room->seq_next,
+  };
+  ServerEncodedPoint ep;
+  server_encode_clientpoint(&cp, &ep);
+
+  ClientFrame *f = client_ws_frame(
+    client_ws_format_opcode(c->ws_format),
+    ep.payload[c->ws_format],
+    ep.payload_len[c->ws_format]
+  );
+  client_ws_send_frame(c, f);
+  client_frame_unref(f);
+
+  server_client_send_snapshot(server, c);
+}
+
 static int server_step_client(Server *server, Client *client) {
   ClientPhase phase_before = client->phase;
+  ClientStepResult result;
 
   restart:
-  switch (client_step(client)) {
+  result = client_step(client);
+
+  /* if they've just established a websocket connection,
+   * send them the last history_points points drawn in their
+   * room before they connected, all in one go. this has to
+   * happen before any of their messages are handled, since
+   * those can come in right behind the upgrade request */
+  if (client->phase != phase_before &&
+      client->phase == ClientPhase_Websocket) {
+    server_room_join(server, client);
+    server_client_send_snapshot(server, client);
+    phase_before = ClientPhase_Websocket;
+    if (result == ClientStepResult_NoAction) goto restart;
+  }
+
+  switch (result) {
 
     case ClientStepResult_Error: {
       server_drop_client(server, client);
@@ -257,47 +2090,20 @@ static int server_step_client(Server *server, Client *client) {
 
       /* let's reset the request so we can
        * start receiving a new one */
-      free(client->ws_req.payload);
-      memset(&client->ws_req, 0, sizeof(client->ws_req));
+      client_ws_req_done(client);
 
       goto restart;
     }; break;
   }
 
-  /* if they've just established a websocket connection,
-   * send them the last POINT_COUNT points drawn before
-   * they connected */
-  if (client->phase != phase_before &&
-      client->phase == ClientPhase_Websocket) {
-
-    for (int i = 0; i < POINT_COUNT; i++) {
-      ClientPoint *cp = server->points + i;
-      if (!cp->action) break;
-
-      {
-        char *msg;
-        size_t msg_len;
-        {
-          FILE *tmp = open_memstream(&msg, &msg_len);
-          clientpoint_fprint(cp, tmp);
-          fclose(tmp);
-        }
-
-        /**
-         * a bit schlemiel-the-painter here,
-         * will walk to the end of response list
-         * to find where to put the next response ...
-         **/
-        client_ws_send_text(client, msg, msg_len);
-
-        free(msg);
-      }
-    }
-
-    phase_before = ClientPhase_Websocket;
+  if (client->ws_resync && client->res_bytes <= CLIENT_WS_QUEUE_LOW) {
+    server_client_resync(server, client);
     goto restart;
   }
 
+  server_client_sync_events(server, client);
+  server_wheel_schedule(server, client);
+
   return 0;
 }
 
@@ -0,0 +1,274 @@
+// vim: sw=2 ts=2 expandtab smartindent
+
+/**
+ * An on-disk copy of a room's point ring (--log=dir), so a restart
+ * comes back up with the canvas everyone left behind.
+ *
+ * The file is a header and then config.history_points ClientPoints,
+ * exactly as they sit in memory, and the file is mmap'd so the room's
+ * chunks point right into it. Taking in a point writes it to the page cache and
+ * nowhere else, and starting back up is one mmap with nothing to parse.
+ *
+ * Nothing gets fsync'd. A point only counts once it's in its slot and
+ * the header's seq has been bumped past it, so a crash halfway through
+ * writing one just loses that point; the kernel writes the rest back
+ * whenever it likes. (Pulling the plug can lose more than that, but
+ * nothing that doesn't look like a point gets let back in.)
+ *
+ * The records are in the host's byte order and layout, so a log only
+ * comes back on the same kind of machine; anything else gets moved
+ * aside and started over.
+ **/
+
+#ifndef server_IMPLEMENTATION
+
+#define SERVER_LOG_MAGIC "cketchbook.log"
+#define SERVER_LOG_VERSION 2
+/* the records start this far in */
+#define SERVER_LOG_HEADER_SIZE 64
+
+typedef struct {
+  char magic[16];
+  uint32_t version, record_size, record_count;
+
+  /**
+   * Only kept up in the "" room's log: one past the highest client id
+   * that has drawn anything, in any room, so a restart doesn't hand
+   * those ids out again and tack new strokes onto old ones.
+   **/
+  uint32_t client_id_next;
+
+  /* how many points have ever been written, the next goes in slot
+   * seq % record_count */
+  _Atomic uint64_t seq;
+} ServerLogHeader;
+
+_Static_assert(
+  sizeof(ServerLogHeader) <= SERVER_LOG_HEADER_SIZE,
+  "ServerLogHeader has outgrown SERVER_LOG_HEADER_SIZE"
+);
+
+typedef struct {
+  /* NULL if this room isn't logged */
+  ServerLogHeader *header;
+  /* right after the header */
+  ClientPoint *points;
+  size_t size;
+} ServerLog;
+
+/**
+ * Maps (or makes) the log at `path`, with room for `count` points.
+ * Anything in there that we can't trust has been cleared out already,
+ * and a file that isn't a log of `count` points is moved to `path`.old.
+ **/
+static bool server_log_open(ServerLog *log, const char *path, size_t count);
+/* call once the point at seq % count has been written */
+static void server_log_append(ServerLog *log);
+static void server_log_close(ServerLog *log);
+
+/**
+ * Just copies what's in the log at `path` into `points`, for shards
+ * that keep their own copy; false (and `points` all empty) if there's
+ * nothing usable there.
+ **/
+static bool server_log_read(
+  const char *path,
+  size_t count,
+  ClientPoint *points,
+  size_t *points_i,
+  uint32_t *client_id_next
+);
+
+#endif
+
+
+#ifdef server_IMPLEMENTATION
+
+static bool server_log_header_ok(ServerLogHeader *h, size_t count) {
+  return memcmp(h->magic, SERVER_LOG_MAGIC, sizeof(SERVER_LOG_MAGIC)) == 0 &&
+         h->version == SERVER_LOG_VERSION &&
+         h->record_size == sizeof(ClientPoint) &&
+         h->record_count == count;
+}
+
+/**
+ * Throws out anything we can't trust: the slot seq points at may have
+ * been halfway through being overwritten, and anything that isn't a
+ * live point is left over from a crash (or isn't ours).
+ **/
+static size_t server_log_check(
+  ClientPoint *points,
+  size_t count,
+  uint64_t seq
+) {
+  size_t points_i = seq % count;
+
+  for (size_t i = 0; i < count; i++) {
+    bool written = seq >= count || i < seq;
+    if (!written || i == points_i ||
+        points[i].action != ClientPointAction_Add)
+      points[i] = (ClientPoint) { .action = ClientPointAction_None };
+  }
+
+  return points_i;
+}
+
+static bool server_log_open(ServerLog *log, const char *path, size_t count) {
+  *log = (ServerLog) {
+    .size = SERVER_LOG_HEADER_SIZE + sizeof(ClientPoint) * count
+  };
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(
+      stderr,
+      "couldn't open point log %s: %s\n",
+      path,
+      strerror(errno)
+    );
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(
+      stderr,
+      "couldn't stat point log %s: %s\n",
+      path,
+      strerror(errno)
+    );
+    close(fd);
+    return false;
+  }
+
+  /**
+   * One made for a different --history (or that isn't ours at all)
+   * would get cut down or wiped below, so it's moved out of the way
+   * first and we start over in a new file.
+   **/
+  if (st.st_size > 0) {
+    ServerLogHeader h;
+    bool ours = (size_t)st.st_size == log->size &&
+                pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+                server_log_header_ok(&h, count);
+    if (!ours) {
+      close(fd);
+
+      /* never on top of an older one that was moved aside */
+      char aside[PATH_MAX + sizeof(".old")];
+      if (snprintf(aside, sizeof(aside), "%s.old", path) >= (int)sizeof(aside)) {
+        fprintf(stderr, "point log %s isn't one we can use, not logging it\n", path);
+        return false;
+      }
+      if (link(path, aside) < 0 || unlink(path) < 0) {
+        fprintf(
+          stderr,
+          "point log %s isn't one we can use and couldn't be moved to %s (%s), not logging it\n",
+          path,
+          aside,
+          strerror(errno)
+        );
+        return false;
+      }
+      fprintf(
+        stderr,
+        "point log %s isn't one we can use, moved it to %s\n",
+        path,
+        aside
+      );
+
+      fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+      if (fd < 0) {
+        fprintf(
+          stderr,
+          "couldn't open point log %s: %s\n",
+          path,
+          strerror(errno)
+        );
+        return false;
+      }
+      st.st_size = 0;
+    }
+  }
+
+  if (ftruncate(fd, log->size) < 0) {
+    fprintf(
+      stderr,
+      "couldn't size point log %s: %s\n",
+      path,
+      strerror(errno)
+    );
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(NULL, log->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  /* the mapping keeps the file around on its own */
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(
+      stderr,
+      "couldn't map point log %s: %s\n",
+      path,
+      strerror(errno)
+    );
+    return false;
+  }
+
+  log->header = map;
+  log->points = (ClientPoint *)((char *)map + SERVER_LOG_HEADER_SIZE);
+
+  /* anything that was already there has been checked above */
+  if (st.st_size == 0) {
+    memset(map, 0, log->size);
+    memcpy(log->header->magic, SERVER_LOG_MAGIC, sizeof(SERVER_LOG_MAGIC));
+    log->header->version = SERVER_LOG_VERSION;
+    log->header->record_size = sizeof(ClientPoint);
+    log->header->record_count = count;
+  }
+
+  server_log_check(log->points, count, log->header->seq);
+  return true;
+}
+
+static void server_log_append(ServerLog *log) {
+  if (log->header == NULL) return;
+
+  /* the point itself has to land before the seq that vouches for it */
+  atomic_fetch_add_explicit(&log->header->seq, 1, memory_order_release);
+}
+
+static void server_log_close(ServerLog *log) {
+  if (log->header) munmap(log->header, log->size);
+  *log = (ServerLog) {0};
+}
+
+static bool server_log_read(
+  const char *path,
+  size_t count,
+  ClientPoint *points,
+  size_t *points_i,
+  uint32_t *client_id_next
+) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  ServerLogHeader h;
+  size_t len = sizeof(ClientPoint) * count;
+  bool ok =
+    pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+    server_log_header_ok(&h, count) &&
+    pread(fd, points, len, SERVER_LOG_HEADER_SIZE) == (ssize_t)len;
+  close(fd);
+
+  if (!ok) {
+    memset(points, 0, len);
+    return false;
+  }
+
+  *points_i = server_log_check(points, count, h.seq);
+  *client_id_next = h.client_id_next;
+  return true;
+}
+
+#endif
@@ -1,18 +1,21 @@
 // vim: sw=2 ts=2 expandtab smartindent
 
 #ifndef socket_IMPLEMENTATION
-static int socket_host_bind(const char *host, const char *port);
+static int socket_host_bind(const char *host, const char *port, bool reuseport);
 static int socket_accept_client(int server_fd);
+static void socket_log_accepted(int fd);
 #endif
 
 #ifdef socket_IMPLEMENTATION
 /*
  * Create a server socket bound to the specified host and port. If 'host'
- * is NULL, this will bind "generically" (all addresses).
+ * is NULL, this will bind "generically" (all addresses). With 'reuseport',
+ * other sockets can bind the same port and the kernel spreads incoming
+ * connections out between them.
  *
  * Returned value is the server socket descriptor, or -1 on error.
  */
-static int socket_host_bind(const char *host, const char *port) {
+static int socket_host_bind(const char *host, const char *port, bool reuseport) {
   struct addrinfo hints, *si, *p;
   int fd;
   int err;
@@ -88,6 +91,8 @@ static int socket_host_bind(const char *host, const char *port) {
     }
     opt = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof opt) < 0)
+      perror("setsockopt(SO_REUSEPORT)");
     opt = 0;
     setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof opt);
     if (bind(fd, sa, sa_len) < 0) {
@@ -117,27 +122,16 @@ static int socket_host_bind(const char *host, const char *port) {
 }
 
 /*
- * Accept a single client on the provided server socket.
- * On error, this returns -1.
+ * Print where a freshly accepted connection is coming from.
  */
-static int socket_accept_client(int server_fd) {
-
-  struct sockaddr sa;
-  socklen_t sa_len = sizeof sa;
-  int fd = accept(server_fd, &sa, &sa_len);
-  if (fd < 0) {
-    if (errno != EWOULDBLOCK && errno != EAGAIN)
-      perror("accept()");
-    return -1;
-  }
-
+static void socket_log_peer(struct sockaddr_storage *ss) {
   const char *name = NULL;
   char tmp[INET6_ADDRSTRLEN + 50];
-  switch (sa.sa_family) {
+  switch (ss->ss_family) {
     case AF_INET:
       name = inet_ntop(
         AF_INET,
-        &((struct sockaddr_in *)&sa)->sin_addr,
+        &((struct sockaddr_in *)ss)->sin_addr,
         tmp,
         sizeof tmp
       );
@@ -145,7 +139,7 @@ static int socket_accept_client(int server_fd) {
     case AF_INET6:
       name = inet_ntop(
         AF_INET6,
-        &((struct sockaddr_in6 *)&sa)->sin6_addr,
+        &((struct sockaddr_in6 *)ss)->sin6_addr,
         tmp,
         sizeof tmp
       );
@@ -153,13 +147,45 @@ static int socket_accept_client(int server_fd) {
   }
 
   if (name == NULL) {
-    sprintf(tmp, "<unknown: %lu>", (unsigned long)sa.sa_family);
+    sprintf(tmp, "<unknown: %lu>", (unsigned long)ss->ss_family);
     name = tmp;
   }
   fprintf(stderr, "accepting connection from: %s\n", name);
+}
+
+/*
+ * Accept a single client on the provided server socket.
+ * On error, this returns -1.
+ */
+static int socket_accept_client(int server_fd) {
+
+  /* big enough for an ipv6 address, unlike a plain struct sockaddr */
+  struct sockaddr_storage ss;
+  socklen_t ss_len = sizeof ss;
+  int fd = accept(server_fd, (struct sockaddr *)&ss, &ss_len);
+  if (fd < 0) {
+    if (errno != EWOULDBLOCK && errno != EAGAIN)
+      perror("accept()");
+    return -1;
+  }
+
+  socket_log_peer(&ss);
 
   /* note: on macos, this is not necessary - only set it on parent! */
   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
   return fd;
 }
+
+/*
+ * For when something else did the accept() for us (e.g. io_uring).
+ */
+static void socket_log_accepted(int fd) {
+  struct sockaddr_storage ss;
+  socklen_t ss_len = sizeof ss;
+  if (getpeername(fd, (struct sockaddr *)&ss, &ss_len) < 0) {
+    perror("getpeername()");
+    return;
+  }
+  socket_log_peer(&ss);
+}
 #endif